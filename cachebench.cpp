@@ -0,0 +1,497 @@
+/*
+ * cachebench: drives the cache models of dcache.H and cache_hierarchy.H
+ * with synthetic GraphIt-like access streams and reports how fast they
+ * run, how much memory they use and how many accesses miss.
+ *
+ * The graphs and streams are generated from fixed seeds, so the miss
+ * counts only change when a model's behavior does. cachebench.golden
+ * holds them for the default graph sizes, and `make -f native.mk check`
+ * compares a fresh run against it. After an intended change of behavior,
+ * regenerate it with: obj-native/cachebench -golden > cachebench.golden
+ *
+ * Build with: make -f native.mk
+ */
+
+#include "native_compat.H"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+#include <new>
+
+#include "dcache.H"
+#include "cache_hierarchy.H"
+#include "energy_model.H"
+
+/* ===================================================================== */
+/* Heap accounting                                                       */
+/* ===================================================================== */
+
+/*
+ * Every allocation carries its size in front, so that the memory of a
+ * model can be measured as the growth of the live heap while it runs.
+ * Single threaded, like the rest of cachebench.
+ */
+static UINT64 heap_bytes = 0;
+static UINT64 heap_peak = 0;
+
+static const size_t heap_header = 16;	// keeps the alignment of operator new
+
+__attribute__((noinline)) VOID *operator new(size_t size)
+{
+    char *block = static_cast<char*>(malloc(size + heap_header));
+    if (!block)
+	throw std::bad_alloc();
+
+    *reinterpret_cast<size_t*>(block) = size;
+    heap_bytes += size;
+    heap_peak = std::max(heap_peak, heap_bytes);
+    return block + heap_header;
+}
+
+__attribute__((noinline)) VOID operator delete(VOID *p) noexcept
+{
+    if (!p)
+	return;
+
+    char *block = static_cast<char*>(p) - heap_header;
+    heap_bytes -= *reinterpret_cast<size_t*>(block);
+    free(block);
+}
+
+VOID *operator new[](size_t size) { return operator new(size); }
+VOID operator delete[](VOID *p) noexcept { operator delete(p); }
+
+/* ===================================================================== */
+/* Synthetic graphs                                                      */
+/* ===================================================================== */
+
+static inline UINT64 Hash(UINT64 x)
+{
+    // splitmix64 finalizer
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * CSR graph with 1 to 15 edges per vertex and a hub of a few hundred
+ * edges every 128 vertices or so. Half of the edges stay within 256
+ * vertices of their source, the others go anywhere, biased to low ids
+ * the way reordered power law graphs are.
+ */
+struct GRAPH
+{
+    UINT32 vertices;
+    std::vector<UINT64> offsets;	// vertices + 1
+
+    GRAPH(UINT32 num_vertices) : vertices(num_vertices), offsets(num_vertices + 1, 0)
+    {
+	for (UINT32 v = 0; v < vertices; v++) {
+	    const UINT64 h = Hash(v);
+	    UINT64 degree = 1 + h % 15;
+
+	    if ((h >> 32) % 128 == 0)
+		degree += 256;
+	    offsets[v + 1] = offsets[v] + degree;
+	}
+    }
+
+    UINT64 Edges() const { return offsets[vertices]; }
+
+    UINT32 Neighbor(UINT32 v, UINT64 edge) const
+    {
+	const UINT64 h = Hash(edge ^ 0x5EED0000ULL);
+
+	if (h & 1)
+	    return (v + (h >> 8) % 256) % vertices;
+	return ((h >> 16) % vertices) >> ((h >> 8) & 7);
+    }
+
+    bool InFrontier(UINT32 v) const { return Hash(v ^ 0xF0F0F0F0ULL) % 8 == 0; }
+    bool Unvisited(UINT32 v) const { return Hash(v ^ 0x0F0F0F0FULL) % 4 == 0; }
+};
+
+/* ===================================================================== */
+/* Access streams                                                        */
+/* ===================================================================== */
+
+/*
+ * One access packed into 64 bits: the address in the low 48, log2 of the
+ * size in bits 56-59 and the store flag in bit 63. The streams are built
+ * before the clock starts, so only the models are timed.
+ */
+typedef UINT64 ACCESS;
+
+const ADDRINT offsets_base  = 0x100000000ULL;	// UINT64 per vertex
+const ADDRINT edges_base    = 0x200000000ULL;	// UINT32 per edge
+const ADDRINT vdata_base    = 0x300000000ULL;	// UINT64 per vertex
+const ADDRINT vnext_base    = 0x400000000ULL;	// UINT64 per vertex
+const ADDRINT frontier_base = 0x500000000ULL;	// UINT32 per frontier vertex
+const ADDRINT next_base     = 0x600000000ULL;	// UINT32 per next frontier vertex
+
+static inline VOID Load(std::vector<ACCESS> &stream, ADDRINT addr, UINT32 size_log2)
+{
+    stream.push_back(addr | (UINT64(size_log2) << 56));
+}
+
+static inline VOID Store(std::vector<ACCESS> &stream, ADDRINT addr, UINT32 size_log2)
+{
+    stream.push_back(addr | (UINT64(size_log2) << 56) | (UINT64(1) << 63));
+}
+
+/* Edge scan: every vertex reads its edge range and its edges, then writes its value */
+static VOID CsrScan(const GRAPH &graph, std::vector<ACCESS> &stream)
+{
+    for (UINT32 v = 0; v < graph.vertices; v++) {
+	Load(stream, offsets_base + v * 8ULL, 3);
+	Load(stream, offsets_base + (v + 1) * 8ULL, 3);
+	for (UINT64 e = graph.offsets[v]; e < graph.offsets[v + 1]; e++)
+	    Load(stream, edges_base + e * 4, 2);
+	Store(stream, vdata_base + v * 8ULL, 3);
+    }
+}
+
+/* Pull step, as in PageRank: every vertex gathers the values of its neighbors */
+static VOID Gather(const GRAPH &graph, std::vector<ACCESS> &stream)
+{
+    for (UINT32 v = 0; v < graph.vertices; v++) {
+	Load(stream, offsets_base + v * 8ULL, 3);
+	Load(stream, offsets_base + (v + 1) * 8ULL, 3);
+	for (UINT64 e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+	    Load(stream, edges_base + e * 4, 2);
+	    Load(stream, vdata_base + graph.Neighbor(v, e) * 8ULL, 3);
+	}
+	Store(stream, vnext_base + v * 8ULL, 3);
+    }
+}
+
+/* Push step, as in BFS: the frontier's neighbors that are unvisited join the next frontier */
+static VOID Frontier(const GRAPH &graph, std::vector<ACCESS> &stream)
+{
+    UINT64 position = 0, next = 0;
+
+    for (UINT32 v = 0; v < graph.vertices; v++) {
+	if (!graph.InFrontier(v))
+	    continue;
+
+	Load(stream, frontier_base + 4 * position++, 2);
+	Load(stream, offsets_base + v * 8ULL, 3);
+	Load(stream, offsets_base + (v + 1) * 8ULL, 3);
+	for (UINT64 e = graph.offsets[v]; e < graph.offsets[v + 1]; e++) {
+	    const UINT32 w = graph.Neighbor(v, e);
+
+	    Load(stream, edges_base + e * 4, 2);
+	    Load(stream, vdata_base + w * 8ULL, 3);
+	    if (graph.Unvisited(w)) {
+		Store(stream, vdata_base + w * 8ULL, 3);
+		Store(stream, next_base + 4 * next++, 2);
+	    }
+	}
+    }
+}
+
+struct STREAM
+{
+    const char *name;
+    VOID (*build)(const GRAPH &graph, std::vector<ACCESS> &stream);
+};
+
+const STREAM streams[] = {
+    { "csr_scan", CsrScan },
+    { "gather",   Gather },
+    { "frontier", Frontier },
+};
+
+/* ===================================================================== */
+/* Models                                                                */
+/* ===================================================================== */
+
+const UINT32 max_sets = 64 * KILO;
+
+typedef CACHE_DIRECT_MAPPED(max_sets, CACHE_ALLOC::STORE_ALLOCATE) CACHE_DIRECT;
+typedef CACHE_ROUND_ROBIN(max_sets, 8, CACHE_ALLOC::STORE_ALLOCATE) CACHE_RR;
+typedef CACHE_ROUND_ROBIN_INFINITE(max_sets, 1, CACHE_ALLOC::STORE_ALLOCATE) CACHE_RR_INFINITE;
+typedef CACHE_COLD_MISS(CACHE_ALLOC::STORE_ALLOCATE) CACHE_COLD_LINES;
+
+/*
+ * ROUND_ROBIN_INFINITE searches every line its set has ever seen, so it
+ * is only run on the graphs it finishes in reasonable time. It has the
+ * wrapper's old geometry, and CACHE_COLD the same line size, so the two
+ * must agree on every miss.
+ */
+const UINT32 rr_infinite_max_vertices = 64 * KILO;
+
+/* The single 4MB round robin cache that modeled the Xeon before XEON_CACHES */
+struct XEON_SINGLE : public CACHE_RR
+{
+    XEON_SINGLE() : CACHE_RR("xeon_single", INTEL_CACHE_SIZE, INTEL_CACHELINE_SIZE, INTEL_ASSOCIATIVITY) {}
+};
+
+/* The cold and Xeon models again, with the default prefetchers of hbpintool */
+struct CACHE_COLD_NEXT_LINE : public CACHE_COLD_LINES
+{
+    PREFETCHER prefetcher;
+
+    CACHE_COLD_NEXT_LINE()
+      : CACHE_COLD_LINES("cold_next_line", 256, 256, 1),
+	prefetcher(PREFETCH::KIND_NEXT_LINE, 2, 2, 256)
+    {
+	SetPrefetcher(&prefetcher);
+    }
+};
+
+struct XEON_STRIDE : public XEON_CACHES
+{
+    PREFETCHER prefetcher;
+
+    XEON_STRIDE() : prefetcher(PREFETCH::KIND_STRIDE, 2, 2, INTEL_CACHELINE_SIZE)
+    {
+	SetPrefetcher(&prefetcher);
+    }
+};
+
+static CACHE_DIRECT *NewCache(CACHE_DIRECT *)
+{
+    return new CACHE_DIRECT("direct", 2 * KILO, 64, 1);
+}
+
+static CACHE_RR *NewCache(CACHE_RR *)
+{
+    return new CACHE_RR("round_robin", 32 * KILO, 64, 8);
+}
+
+static CACHE_RR_INFINITE *NewCache(CACHE_RR_INFINITE *)
+{
+    return new CACHE_RR_INFINITE("rr_infinite", 2 * KILO, 256, 1);
+}
+
+static CACHE_COLD_LINES *NewCache(CACHE_COLD_LINES *)
+{
+    return new CACHE_COLD_LINES("cold", 256, 256, 1);
+}
+
+static XEON_CACHES *NewCache(XEON_CACHES *)
+{
+    return new XEON_CACHES();
+}
+
+static XEON_SINGLE *NewCache(XEON_SINGLE *)
+{
+    return new XEON_SINGLE();
+}
+
+static CACHE_COLD_NEXT_LINE *NewCache(CACHE_COLD_NEXT_LINE *)
+{
+    return new CACHE_COLD_NEXT_LINE();
+}
+
+static XEON_STRIDE *NewCache(XEON_STRIDE *)
+{
+    return new XEON_STRIDE();
+}
+
+struct RESULT
+{
+    UINT64 accesses;
+    UINT64 misses;
+    double seconds;
+    double megabytes;	// largest heap the model had
+};
+
+
+template <class CACHE>
+static RESULT Run(const std::vector<ACCESS> &stream)
+{
+    const UINT64 before = heap_bytes;
+    heap_peak = heap_bytes;
+
+    CACHE *cache = NewCache((CACHE*) NULL);
+    RESULT result = { stream.size(), 0, 0, 0 };
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (UINT64 i = 0; i < stream.size(); i++) {
+	const ACCESS access = stream[i];
+	const ADDRINT addr = access & ((UINT64(1) << 48) - 1);
+	const UINT32 size = 1u << ((access >> 56) & 0xf);
+	const CACHE_BASE::ACCESS_TYPE type = access >> 63
+	    ? CACHE_BASE::ACCESS_TYPE_STORE : CACHE_BASE::ACCESS_TYPE_LOAD;
+
+	if (!cache->Access(addr, size, type))
+	    result.misses++;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    result.megabytes = double(heap_peak - before) / MEGA;
+    delete cache;
+    return result;
+}
+
+struct MODEL
+{
+    const char *name;
+    RESULT (*run)(const std::vector<ACCESS> &stream);
+    UINT32 max_vertices;	// 0 for any graph
+};
+
+const MODEL models[] = {
+    { "direct",          Run<CACHE_DIRECT>,             0 },
+    { "round_robin",     Run<CACHE_RR>,                 0 },
+    { "rr_infinite",     Run<CACHE_RR_INFINITE>,        rr_infinite_max_vertices },
+    { "cold",            Run<CACHE_COLD_LINES>,         0 },
+    { "xeon",            Run<XEON_CACHES>,              0 },
+    { "xeon_single",     Run<XEON_SINGLE>,              0 },
+    { "cold_next_line",  Run<CACHE_COLD_NEXT_LINE>,     0 },
+    { "xeon_stride",     Run<XEON_STRIDE>,              0 },
+};
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+static int Usage(const char *name)
+{
+    cerr << "Usage: " << name << " [options]\n"
+	 << "Runs the cache models on synthetic graph access streams.\n"
+	 << "Options:\n"
+	 << "    -v LIST     graph sizes in vertices (default 4096,65536,524288)\n"
+	 << "    -golden     only print the miss counts, in the format of cachebench.golden\n"
+	 << "    -check FILE compare the miss counts against FILE, exit 1 on any difference\n";
+    return 1;
+}
+
+static bool ParseList(const std::string &text, std::vector<UINT32> &values)
+{
+    std::istringstream in(text);
+    UINT32 value;
+
+    values.clear();
+    while (in >> value) {
+	values.push_back(value);
+	if (in.peek() == ',')
+	    in.ignore();
+    }
+    return in.eof() && !values.empty();
+}
+
+static std::string Key(const char *stream, UINT32 vertices, const char *model)
+{
+    return std::string(stream) + " " + decstr(vertices) + " " + model;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<UINT32> sizes;
+    bool golden = false;
+    std::string check;
+
+    sizes.push_back(4 * KILO);
+    sizes.push_back(64 * KILO);
+    sizes.push_back(512 * KILO);
+
+    for (int i = 1; i < argc; i++) {
+	std::string arg = argv[i];
+	bool has_value = i + 1 < argc;
+
+	if (arg == "-v" && has_value) {
+	    if (!ParseList(argv[++i], sizes))
+		return Usage(argv[0]);
+	} else if (arg == "-golden") {
+	    golden = true;
+	} else if (arg == "-check" && has_value) {
+	    check = argv[++i];
+	} else {
+	    return Usage(argv[0]);
+	}
+    }
+
+    // "stream vertices model" => "accesses misses"
+    std::map<std::string, std::string> expected;
+    if (!check.empty()) {
+	std::ifstream in(check.c_str());
+	std::string stream, model;
+	UINT32 vertices;
+	UINT64 accesses, misses;
+
+	if (!in) {
+	    cerr << "Error: could not open " << check << "\n";
+	    return 1;
+	}
+	while (in >> stream >> vertices >> model >> accesses >> misses)
+	    expected[Key(stream.c_str(), vertices, model.c_str())] = decstr(accesses) + " " + decstr(misses);
+    }
+
+    if (!golden) {
+	cout << std::setw(10) << "stream"
+	     << std::setw(10) << "vertices"
+	     << std::setw(10) << "edges"
+	     << std::setw(16) << "model"
+	     << std::setw(12) << "accesses"
+	     << std::setw(12) << "misses"
+	     << std::setw(12) << "Macc/s"
+	     << std::setw(10) << "model-MB" << "\n";
+    }
+
+    UINT32 failures = 0;
+    for (UINT32 g = 0; g < sizes.size(); g++) {
+	const GRAPH graph(sizes[g]);
+
+	for (UINT32 s = 0; s < sizeof(streams) / sizeof(streams[0]); s++) {
+	    std::vector<ACCESS> stream;
+	    streams[s].build(graph, stream);
+
+	    for (UINT32 m = 0; m < sizeof(models) / sizeof(models[0]); m++) {
+		if (models[m].max_vertices && graph.vertices > models[m].max_vertices)
+		    continue;
+
+		const RESULT result = models[m].run(stream);
+		const std::string key = Key(streams[s].name, graph.vertices, models[m].name);
+		const std::string counts = decstr(result.accesses) + " " + decstr(result.misses);
+
+		if (golden) {
+		    cout << key << " " << counts << "\n";
+		    continue;
+		}
+
+		cout << std::setw(10) << streams[s].name
+		     << std::setw(10) << graph.vertices
+		     << std::setw(10) << graph.Edges()
+		     << std::setw(16) << models[m].name
+		     << std::setw(12) << result.accesses
+		     << std::setw(12) << result.misses
+		     << std::setw(12) << std::fixed << std::setprecision(1)
+		     << (result.seconds > 0 ? result.accesses / result.seconds / 1e6 : 0)
+		     << std::setw(10) << result.megabytes << "\n";
+
+		if (!check.empty()) {
+		    std::map<std::string, std::string>::const_iterator it = expected.find(key);
+
+		    if (it == expected.end()) {
+			cerr << "FAIL: " << key << " has no golden counts\n";
+			failures++;
+		    } else if (it->second != counts) {
+			cerr << "FAIL: " << key << ": " << counts << ", expected " << it->second << "\n";
+			failures++;
+		    }
+		}
+	    }
+	}
+    }
+
+    if (!check.empty()) {
+	if (failures) {
+	    cerr << "FAIL: " << failures << " miss counts differ from " << check << "\n";
+	    return 1;
+	}
+	cout << "PASS\n";
+    }
+    return 0;
+}
@@ -39,19 +39,29 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <sstream>
 #include <vector>
 #include <map>
+#include <deque>
+#include <set>
 #include <algorithm>
+#include <cstddef>
+#include <cmath>
+#include <cstdlib>
+#include <time.h>
+#include <unistd.h>
 
 #include "dcache.H"
+#include "cache_hierarchy.H"
+#include "energy_model.H"
+#include "hbm_model.H"
+#include "memop_profile.H"
+#include "cache_sweep.H"
+#include "trace_format.H"
 #include "pin_profile.H"
 #include "instlib.H"
 #include "filter.H"
 
-#define INTEL_CACHE_SIZE     ((64 * MEGA)/16)
-#define INTEL_CACHELINE_SIZE  64
-#define INTEL_ASSOCIATIVITY   8
-
 std::ofstream outFile;
 INSTLIB::FILTER_RTN filter;
 
@@ -69,6 +79,8 @@ KNOB<UINT32> KnobThresholdHit(KNOB_MODE_WRITEONCE , "pintool",
 			      "rh", "100", "only report memops with hit count above threshold");
 KNOB<UINT32> KnobThresholdMiss(KNOB_MODE_WRITEONCE, "pintool",
 			       "rm","100", "only report memops with miss count above threshold");
+KNOB<UINT32> KnobAllocationMin(KNOB_MODE_WRITEONCE, "pintool",
+			       "alloc_min", "4096", "attribute tracked misses to heap allocations of at least this many bytes");
 KNOB<UINT32> KnobCacheSize(KNOB_MODE_WRITEONCE, "pintool",
 			   "c","32", "cache size in kilobytes");
 KNOB<UINT32> KnobLineSize(KNOB_MODE_WRITEONCE, "pintool",
@@ -79,13 +91,88 @@ KNOB<UINT32> KnobAssociativity(KNOB_MODE_WRITEONCE, "pintool",
 KNOB<BOOL> KnobColdOnly(KNOB_MODE_WRITEONCE, "pintool",
 			"co", "1", "only count 'cold' cache misses");
 
-KNOB<std::string> KnobRtnEpochMarker(KNOB_MODE_WRITEONCE, "pintool",
-                                     "epoch_marker", "", "Routine to set as the epoch marker");
-
-typedef std::pair<UINT32, double> CLSIZE_WATTS_PAIR;
-typedef std::pair<UINT32, double> CLSIZE_LATENCY_PAIR;
-typedef std::map<UINT32, double>  POWER_MAP;   // access size => power in watts
-typedef std::map<UINT32, double>  LATENCY_MAP; // access size => latency in ns
+KNOB<std::string> KnobRtnEpochMarker(KNOB_MODE_APPEND, "pintool",
+                                     "epoch_marker", "", "Routine to set as the epoch marker (may be repeated)");
+
+KNOB<BOOL> KnobBblCount(KNOB_MODE_WRITEONCE, "pintool",
+                        "bbl", "1", "count instructions per basic block and skip repeated line hits inline");
+
+KNOB<BOOL> KnobBuffer(KNOB_MODE_WRITEONCE, "pintool",
+                      "buffer", "0", "simulate the caches on a separate thread fed through trace buffers (requires -bbl)");
+KNOB<UINT32> KnobBufferPages(KNOB_MODE_WRITEONCE, "pintool",
+                             "buffer_pages", "256", "size of each trace buffer in pages");
+KNOB<UINT32> KnobBufferCount(KNOB_MODE_WRITEONCE, "pintool",
+                             "buffer_count", "2", "number of trace buffers in the ring");
+
+KNOB<BOOL> KnobPerThread(KNOB_MODE_WRITEONCE, "pintool",
+                         "per_thread", "0", "also report GOPS/Watt for every thread");
+KNOB<BOOL> KnobEpochStats(KNOB_MODE_WRITEONCE, "pintool",
+                          "epoch_stats", "1", "report misses, instructions and energy for every epoch");
+
+KNOB<UINT32> KnobHbmBurst(KNOB_MODE_WRITEONCE, "pintool",
+                          "hbm_burst", "0", "largest HBM burst in bytes (0 for the largest the HBM tables cover)");
+KNOB<UINT32> KnobHbmGBps(KNOB_MODE_WRITEONCE, "pintool",
+                         "hbm_gbps", "256", "peak HBM bandwidth in GB/s");
+KNOB<UINT32> KnobHbmChannels(KNOB_MODE_WRITEONCE, "pintool",
+                             "hbm_channels", "8", "HBM channels the addresses are interleaved over");
+KNOB<UINT32> KnobHbmBanks(KNOB_MODE_WRITEONCE, "pintool",
+                          "hbm_banks", "16", "banks per HBM channel");
+KNOB<UINT32> KnobHbmInterleave(KNOB_MODE_WRITEONCE, "pintool",
+                               "hbm_interleave", "256", "bytes mapped to one HBM channel before the next");
+KNOB<UINT32> KnobHbmWindow(KNOB_MODE_WRITEONCE, "pintool",
+                           "hbm_window", "0", "bursts per window of the HBM parallelism histograms (0 for -hb_cores)");
+KNOB<string> KnobHbPrefetch(KNOB_MODE_WRITEONCE, "pintool",
+                            "hb_prefetch", "off", "HammerBlade prefetcher: off, none (only classify misses), next_line or stride");
+KNOB<string> KnobXeonPrefetch(KNOB_MODE_WRITEONCE, "pintool",
+                              "xeon_prefetch", "off", "Xeon L2 prefetcher: off, none (only classify misses), next_line or stride");
+KNOB<UINT32> KnobPrefetchDegree(KNOB_MODE_WRITEONCE, "pintool",
+                                "prefetch_degree", "2", "lines each prefetch runs ahead, at most 8");
+KNOB<UINT32> KnobPrefetchLate(KNOB_MODE_WRITEONCE, "pintool",
+                              "prefetch_late", "2", "a prefetched line used within this many line accesses of its cache was late");
+KNOB<UINT32> KnobHbCores(KNOB_MODE_WRITEONCE, "pintool",
+                         "hb_cores", "128", "HammerBlade cores, each with one outstanding HBM burst");
+KNOB<UINT32> KnobHbMHz(KNOB_MODE_WRITEONCE, "pintool",
+                       "hb_mhz", "1000", "HammerBlade core clock in MHz");
+
+KNOB<BOOL> KnobSweep(KNOB_MODE_WRITEONCE, "pintool",
+                     "sweep", "0", "also report misses and GOPS/Watt for a grid of LRU caches, in the same run");
+KNOB<string> KnobSweepLines(KNOB_MODE_WRITEONCE, "pintool",
+                            "sweep_lines", "32,64,256", "comma separated line sizes in bytes for -sweep");
+KNOB<UINT32> KnobSweepMinKB(KNOB_MODE_WRITEONCE, "pintool",
+                            "sweep_min_kb", "1", "smallest cache size for -sweep in kilobytes");
+KNOB<UINT32> KnobSweepMaxKB(KNOB_MODE_WRITEONCE, "pintool",
+                            "sweep_max_kb", "16384", "largest cache size for -sweep in kilobytes");
+KNOB<UINT32> KnobSweepMB(KNOB_MODE_WRITEONCE, "pintool",
+                         "sweep_mb", "8192", "memory for the -sweep caches of all threads in megabytes, lowers -sweep_max_kb to fit");
+
+KNOB<string> KnobTraceOut(KNOB_MODE_WRITEONCE, "pintool",
+                          "trace_out", "", "also write the memory trace to this file for hbreplay");
+KNOB<UINT32> KnobTraceChunkKB(KNOB_MODE_WRITEONCE, "pintool",
+                              "trace_chunk_kb", "1024", "encoded size of one -trace_out chunk in kilobytes");
+
+KNOB<string> KnobTelemetry(KNOB_MODE_WRITEONCE, "pintool",
+                           "telemetry", "", "write a CSV row of the running totals to this file while the program runs");
+KNOB<UINT32> KnobTelemetryMs(KNOB_MODE_WRITEONCE, "pintool",
+                             "telemetry_ms", "1000", "milliseconds between -telemetry rows");
+KNOB<UINT64> KnobTelemetryInstructions(KNOB_MODE_WRITEONCE, "pintool",
+                                       "telemetry_instructions", "0", "only write a -telemetry row once this many more instructions ran (0 for every row)");
+KNOB<string> KnobRoiStart(KNOB_MODE_APPEND, "pintool",
+                          "roi_start", "", "only simulate after a call of this routine (may be repeated)");
+KNOB<string> KnobRoiStop(KNOB_MODE_APPEND, "pintool",
+                         "roi_stop", "", "stop simulating at a call of this routine (may be repeated)");
+KNOB<BOOL> KnobRoiMagic(KNOB_MODE_WRITEONCE, "pintool",
+                        "roi_magic", "0", "start simulating at xchg %bx,%bx and stop at xchg %cx,%cx");
+KNOB<string> KnobKernel(KNOB_MODE_APPEND, "pintool",
+                        "kernel", "", "report instructions and misses of calls of this routine separately (may be repeated)");
+
+KNOB<UINT64> KnobSamplePeriod(KNOB_MODE_WRITEONCE, "pintool",
+                              "sample_period", "0", "simulate one detailed window every this many instructions per thread (0 simulates everything)");
+KNOB<UINT64> KnobSampleDetail(KNOB_MODE_WRITEONCE, "pintool",
+                              "sample_detail", "1000000", "instructions in each detailed -sample_period window");
+KNOB<UINT64> KnobSampleWarm(KNOB_MODE_WRITEONCE, "pintool",
+                            "sample_warm", "100000", "instructions before each detailed window that only warm the caches");
+KNOB<BOOL> KnobSampleFunctionalWarm(KNOB_MODE_WRITEONCE, "pintool",
+                                    "sample_functional_warm", "1", "mark the lines touched while fast forwarding in the HammerBlade cache");
 
 #define array_size(x)				\
     (sizeof(x)/sizeof(x[0]))
@@ -115,14 +202,10 @@ namespace DL1
     const UINT32 max_associativity = 256; // associativity;
     const CACHE_ALLOC::STORE_ALLOCATION allocation = CACHE_ALLOC::STORE_ALLOCATE;
 
-    typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, allocation) CACHE_INTEL;
-    typedef CACHE_ROUND_ROBIN_INFINITE(max_sets, max_associativity, allocation) CACHE_HAMMERBLADE;
+    typedef XEON_CACHES CACHE_INTEL;
+    typedef CACHE_COLD_MISS(allocation) CACHE_HAMMERBLADE;
 }
 
-DL1::CACHE_HAMMERBLADE* dl1 = NULL;
-
-DL1::CACHE_INTEL *dl1_intel = NULL;
-
 typedef enum
 {
     COUNTER_MISS = 0,
@@ -133,259 +216,2861 @@ typedef enum
 
 
 typedef  COUNTER_ARRAY<UINT64, COUNTER_NUM> COUNTER_HIT_MISS;
-typedef std::vector<DL1::CACHE_HAMMERBLADE*>DL1_ARRAY;
 
-// holds the counters with misses and hits
-// conceptually this is an array indexed by instruction address
-// COMPRESSOR_COUNTER<ADDRINT, UINT32, COUNTER_HIT_MISS> profile;
-// COMPRESSOR_COUNTER<ADDRINT, UINT32, COUNTER_HIT_MISS> profile_intel;
-
-DL1_ARRAY hammerblade_dl1s;
+// holds the counters with misses and hits of the loads and stores
+// selected by -tl and -ts; MEMOP_ENTRY counters are indexed by COUNTER
+MEMOP_PROFILE profile;
+COUNTER_HIT_MISS threshold;	// only report memops that reach one of these
 
 
 typedef std::vector<UINT64> ICOUNTER;
 
-/* indexed by COUNTER */
+/* indexed by COUNTER, summed over all threads at Fini */
 ICOUNTER hammerblade_icount(COUNTER_NUM, 0);
 ICOUNTER intel_icount(COUNTER_NUM,0);
 
+/*
+ * Records written to the trace buffer in -buffer mode
+ */
+typedef enum
+{
+    MEMREF_LOAD,
+    MEMREF_STORE,
+    MEMREF_STORE_OF_LOAD  // store half of an instruction that also loads
+} MEMREF_TYPE;
+
+struct MEMREF
+{
+    ADDRINT addr;
+    UINT32  size;
+    UINT32  type;
+    UINT32  slot;	// profile slot of the instruction
+};
+
+/*
+ * Bumped whenever the epoch marker is reached. Each thread compares it to
+ * the epoch its HammerBlade cache was built for before simulating, so
+ * other threads pick up the reset without anyone touching their caches.
+ */
+volatile UINT32 hammerblade_epoch = 0;
 
+HBM_TABLES *hbm_tables = NULL;
+UINT32 hbm_burst;	// largest HBM burst in bytes
+UINT32 hbm_window;	// bursts per HBM_CHANNELS window
 
-/* ===================================================================== */
+/* -hb_prefetch and -xeon_prefetch; no prefetcher is attached when off */
+bool hb_prefetching = false, xeon_prefetching = false;
+PREFETCH::KIND hb_prefetch_kind, xeon_prefetch_kind;
 
-static void ResetDl1(void)
-{    
+double sample_scale = 1;	// all instructions / detailed ones, set at Fini
+
+/*
+ * -sweep models, one per line size. Like dl1 and dl1_intel every thread
+ * builds its own from these, and ReportSweep sums their misses.
+ */
+struct SWEEP_CONFIG
+{
+    UINT32 line_size;
+    UINT32 min_sets;
+    UINT32 max_sets;
+};
+
+std::vector<SWEEP_CONFIG> sweep_configs;
+UINT32 sweep_min_kb, sweep_max_kb;	// after rounding and fitting -sweep_mb
+UINT32 sweep_threads;			// the threads sweep_max_kb was fitted for
+bool sweep_lowered = false;		// sweep_max_kb is below -sweep_max_kb
+
+/*
+ * -trace_out file. Every thread encodes its own chunks and only takes
+ * trace_lock to append a full one.
+ */
+std::ofstream trace_file;
+PIN_LOCK trace_lock;
+bool tracing = false;
+
+/*
+ * Region of interest. Outside it the traces only carry the marker calls;
+ * every transition throws away all instrumentation so that the code is
+ * instrumented again for the new state.
+ */
+bool roi_markers = false;		// any -roi_* knob was given
+volatile bool roi_active = true;
+UINT64 roi_entries = 0;
+PIN_LOCK roi_lock;
+std::set<ADDRINT> roi_start_addrs, roi_stop_addrs;	// of the -roi_start/-roi_stop routines
+
+std::set<std::string> epoch_markers;
+std::vector<std::string> kernels;	// -kernel routines, by kernel index
+
+/* one -kernel routine, summed over its outermost calls */
+struct KERNEL_STATS
+{
+    UINT64 calls;
+    UINT64 instructions;
+    UINT64 hammerblade_misses;
+    UINT64 intel_misses;
+};
+
+/*
+ * -sample_period phases. A period is fast forward, then warm, then
+ * detailed; only the detailed window counts misses.
+ */
+typedef enum
+{
+    SAMPLE_FAST_FORWARD,	// only instructions are counted
+    SAMPLE_WARM,		// accesses update the caches but are not counted
+    SAMPLE_DETAILED,		// everything is simulated and counted
+    SAMPLE_NUM
+} SAMPLE_PHASE;
+
+bool sampling = false;
+UINT64 sample_length[SAMPLE_NUM];	// instructions in each phase
+
+/* instructions and misses of one detailed window */
+struct SAMPLE_WINDOW
+{
+    UINT64 instructions;
+    UINT64 hammerblade_misses;
+    UINT64 intel_misses;
+};
+
+/*
+ * Simulation state of one application thread. Each thread runs its own
+ * copies of both cache models and only writes its own counters, so no
+ * analysis routine takes a lock; the counters are summed at Fini.
+ */
+class THREAD_DATA
+{
+  public:
+    THREAD_DATA(THREADID tid);
+
+    VOID CheckEpoch()
+    {
+	if (epoch != hammerblade_epoch)
+	    NewEpoch();
+    }
+
+    VOID NewEpoch();
+
+    UINT64 Instructions() const
+    {
+	return hammerblade_icount[COUNTER_HIT] + hammerblade_icount[COUNTER_MISS];
+    }
+
+    /* misses so far, including the ones the simulation thread has found */
+    UINT64 HammerbladeMisses() const
+    {
+	return hammerblade_icount[COUNTER_MISS] + buffered_hammerblade_misses;
+    }
+
+    UINT64 IntelMisses() const
+    {
+	return intel_icount[COUNTER_MISS] + buffered_intel_misses;
+    }
+
+    const THREADID tid;
+
+    DL1::CACHE_HAMMERBLADE *dl1;
+    DL1::CACHE_INTEL *dl1_intel;
+    UINT32 epoch;		// hammerblade_epoch that dl1 was reset for
+
+    /* indexed by COUNTER */
+    UINT64 hammerblade_icount[COUNTER_NUM];
+    UINT64 intel_icount[COUNTER_NUM];
+
+    /*
+     * Line last touched by a simulated access, in units of the smaller of
+     * the two models' line sizes. Both models allocate on every miss, so
+     * this line is resident in both of them and another access that stays
+     * inside it is a hit that does not change either model's state.
+     */
+    ADDRINT last_line;
+
+    /* -sample_period; without it the thread stays in SAMPLE_DETAILED */
+    UINT32 sample_phase;
+    UINT64 phase_end;		// Instructions() at which sample_phase ends
+    ADDRINT simulate_mask;	// 0 while skipping memops, ~0 otherwise
+    SAMPLE_WINDOW window_start;
+    std::vector<SAMPLE_WINDOW> windows;
+    SAMPLE_WINDOW sampled;	// sum of windows, which the telemetry thread may not read
+
+    /* -kernel */
+    UINT32 kernel;		// index of the running kernel
+    UINT32 kernel_depth;	// 0 outside of every kernel
+    KERNEL_STATS kernel_start;
+    std::vector<KERNEL_STATS> kernel_stats;	// by kernel index
+
+    HBM_CHANNELS hbm_channels;	// fed by hbm's bursts
+    HBM_MODEL hbm;		// fed by dl1's misses and prefetches
+
+    PREFETCHER *hb_prefetcher;		// NULL unless -hb_prefetch
+    PREFETCHER *xeon_prefetcher;	// NULL unless -xeon_prefetch
+
+    std::vector<CACHE_SWEEP*> sweeps;	// one per sweep_configs entry
+
+    TRACE_WRITER *trace;	// NULL unless -trace_out
+
+    /* -buffer mode */
+    std::vector<MEMREF*> free_buffers;	// guarded by buffer_lock
+    PIN_SEMAPHORE buffer_free_sem;	// set while free_buffers is not empty
+    bool pending_intel_hit;		// hit state of the instruction
+    bool pending_hammerblade_hit;	// whose records are being simulated
+    UINT32 pending_slot;
+    ADDRINT pending_miss_addr;
+
+    /*
+     * Misses found by the simulation thread. The application thread keeps
+     * counting its instructions as hits meanwhile, so these are moved over
+     * from the hit counters only at Fini, once the simulation thread is gone.
+     */
+    UINT64 buffered_intel_misses;
+    UINT64 buffered_hammerblade_misses;
+
+    /* allocation currently being made, see AllocEnter */
+    UINT32 alloc_depth;
+    ADDRINT alloc_size;
+    ADDRINT alloc_site;
+
+  private:
+    // keep the next thread's counters off our cache lines
+    UINT8 _pad[64];
+};
+
+THREAD_DATA::THREAD_DATA(THREADID tid)
+  : tid(tid),
+    epoch(0),
+    last_line(~(ADDRINT)0),
+    sample_phase(SAMPLE_DETAILED),
+    phase_end(~(UINT64)0),
+    simulate_mask(~(ADDRINT)0),
+    sampled(SAMPLE_WINDOW()),
+    kernel(0),
+    kernel_depth(0),
+    kernel_stats(kernels.size()),
+    hbm_channels(KnobHbmChannels.Value(), KnobHbmBanks.Value(), KnobHbmInterleave.Value(), hbm_window),
+    hbm(hbm_tables, KnobLineSize.Value(), hbm_burst, KnobHbmGBps.Value() * 1e9),
+    hb_prefetcher(NULL),
+    xeon_prefetcher(NULL),
+    trace(NULL),
+    pending_intel_hit(true),
+    pending_hammerblade_hit(true),
+    pending_slot(MEMOP_PROFILE::NO_SLOT),
+    pending_miss_addr(0),
+    buffered_intel_misses(0),
+    buffered_hammerblade_misses(0),
+    alloc_depth(0),
+    alloc_size(0),
+    alloc_site(0)
+{
+    dl1_intel = new DL1::CACHE_INTEL();
     dl1 = new DL1::CACHE_HAMMERBLADE("HammerBlade L1",
 				     KnobCacheSize.Value() * KILO,
 				     KnobLineSize.Value(),
 				     KnobAssociativity.Value());
-    hammerblade_dl1s.push_back(dl1);
+    dl1->SetMissCallback(HBM_MODEL::MissCallback, &hbm);
+    hbm.SetChannels(&hbm_channels);
+
+    if (hb_prefetching) {
+	hb_prefetcher = new PREFETCHER(hb_prefetch_kind, KnobPrefetchDegree.Value(),
+				       KnobPrefetchLate.Value(), KnobLineSize.Value());
+	dl1->SetPrefetcher(hb_prefetcher);
+    }
+    if (xeon_prefetching) {
+	xeon_prefetcher = new PREFETCHER(xeon_prefetch_kind, KnobPrefetchDegree.Value(),
+					 KnobPrefetchLate.Value(), INTEL_CACHELINE_SIZE);
+	dl1_intel->SetPrefetcher(xeon_prefetcher);
+    }
+    for (UINT32 i = 0; i < sweep_configs.size(); i++) {
+	const SWEEP_CONFIG &config = sweep_configs[i];
+	sweeps.push_back(new CACHE_SWEEP(config.line_size, config.min_sets, config.max_sets));
+    }
+    epoch = hammerblade_epoch;
+
+    for (UINT32 i = 0; i < COUNTER_NUM; i++)
+	hammerblade_icount[i] = intel_icount[i] = 0;
+
+    PIN_SemaphoreInit(&buffer_free_sem);
 }
 
-void Routine(RTN rtn, void *v)
+VOID THREAD_DATA::NewEpoch()
 {
-    if (!filter.SelectRtn(rtn))
-	return;
-    
-    // reset dl1 every time the epoch marker is called
-    if (RTN_Name(rtn) == KnobRtnEpochMarker.Value()) {
-	RTN_Open(rtn);
-	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) ResetDl1, IARG_END);
-	RTN_Close(rtn);
-    }	
+    epoch = hammerblade_epoch;
+    dl1->Reset();
+
+    if (trace)
+	trace->Mark(hammerblade_icount[COUNTER_HIT] + hammerblade_icount[COUNTER_MISS],
+		    TRACE_MARK_EPOCH);
 }
 
-static
-VOID CountInstruction(bool intel_hit, bool hammerblade_hit)
+const UINT32 max_threads = 1024;
+
+/*
+ * Indexed by THREADID. ThreadStart fills in a slot once and nothing else
+ * writes to it, so Fini can walk it without locking.
+ */
+THREAD_DATA *thread_data[max_threads];
+volatile UINT32 num_threads = 0;	// one past the highest THREADID seen
+
+TLS_KEY thread_data_key;
+REG thread_data_reg;	// holds the running thread's THREAD_DATA*
+
+UINT32 last_line_shift;
+
+/*
+ * Totals over all threads at the start of each epoch; consecutive entries
+ * give the work done by one call of the epoch marker
+ */
+struct EPOCH_STATS
+{
+    UINT64 instructions;
+    UINT64 hammerblade_misses;
+    UINT64 intel_misses;
+};
+
+std::vector<EPOCH_STATS> epoch_starts;
+PIN_LOCK epoch_lock;
+
+/* ===================================================================== */
+
+static VOID BeginEpoch(INT32 owner)
 {
-    intel_icount[intel_hit ? COUNTER_HIT : COUNTER_MISS]++;
-    hammerblade_icount[hammerblade_hit ? COUNTER_HIT : COUNTER_MISS]++;
+    EPOCH_STATS totals = { 0, 0, 0 };
+
+    for (UINT32 tid = 0; tid < num_threads; tid++) {
+	const THREAD_DATA *td = thread_data[tid];
+	if (!td)
+	    continue;
+
+	totals.instructions += td->hammerblade_icount[COUNTER_HIT] + td->hammerblade_icount[COUNTER_MISS];
+	totals.hammerblade_misses += td->HammerbladeMisses();
+	totals.intel_misses += td->IntelMisses();
+    }
+
+    PIN_GetLock(&epoch_lock, owner);
+    epoch_starts.push_back(totals);
+    hammerblade_epoch++;
+    PIN_ReleaseLock(&epoch_lock);
 }
 
-static
-VOID LoadStoreInstruction(ADDRINT read_addr,  UINT32 read_size,
-			  ADDRINT write_addr, UINT32 write_size)
+/*
+ * The epoch marker is called between parallel regions, so the other
+ * threads are idle and simply rebuild their caches when they next miss.
+ * Nobody touches their last_line either: IfNotLastLine stops filtering
+ * as soon as a thread's epoch is behind.
+ */
+static void ResetDl1(THREADID tid)
+{    
+    if (roi_active)
+	BeginEpoch(tid + 1);
+}
+
+/* ===================================================================== */
+/* Memory instruction and allocation profile (-tl / -ts)                 */
+/*                                                                       */
+/* Every tracked memop counts its hits and misses in its profile slot.   */
+/* Misses are also charged to the heap allocation the address falls in, */
+/* so the report can tell e.g. the edge array from the frontier.         */
+/* ===================================================================== */
+
+/*
+ * Where an instruction or allocation site is. Names are interned so the
+ * many memops of one routine share a single copy.
+ */
+struct SOURCE_LOCATION
 {
-    bool intel_hit, hammerblade_hit;
+    const std::string *rtn;
+    const std::string *file;
+    INT32 line;
+};
+
+std::set<std::string> symbol_names;	// guarded by the client lock
 
-    intel_hit = dl1_intel->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
-    hammerblade_hit = dl1->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+std::vector<SOURCE_LOCATION> memop_sources;	// indexed by profile slot
+
+struct ALLOCATION
+{
+    ADDRINT start;
+    ADDRINT size;
+    SOURCE_LOCATION site;	// caller of the outermost allocation function
+    UINT64 hammerblade_misses;
+    UINT64 intel_misses;
+};
+
+PIN_RWMUTEX allocation_lock;				// guards live_allocations
+std::map<ADDRINT, ALLOCATION*> live_allocations;	// by start address
+std::vector<ALLOCATION*> allocations;			// every one ever tracked
+ALLOCATION unattributed;	// misses outside of any tracked allocation
+
+/* caller holds the client lock */
+static SOURCE_LOCATION Locate(ADDRINT addr)
+{
+    SOURCE_LOCATION location;
+    std::string file;
+    INT32 column;
 
-    intel_hit &= dl1_intel->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
-    hammerblade_hit &= dl1->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+    location.line = 0;
+    PIN_GetSourceLocation(addr, &column, &location.line, &file);
+    location.rtn = &*symbol_names.insert(RTN_FindNameByAddress(addr)).first;
+    location.file = &*symbol_names.insert(file).first;
 
-    CountInstruction(intel_hit, hammerblade_hit);
+    return location;
 }
 
-static
-VOID LoadInstruction(ADDRINT read_addr, UINT32 read_size)
+static VOID AttributeMiss(ADDRINT addr, bool intel_hit, bool hammerblade_hit)
 {
-    bool intel_hit, hammerblade_hit;
+    PIN_RWMutexReadLock(&allocation_lock);
+
+    ALLOCATION *allocation = &unattributed;
+    std::map<ADDRINT, ALLOCATION*>::iterator it = live_allocations.upper_bound(addr);
+    if (it != live_allocations.begin()) {
+	--it;
+	if (addr - it->first < it->second->size)
+	    allocation = it->second;
+    }
 
-    intel_hit = dl1_intel->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
-    hammerblade_hit = dl1->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+    // other threads may be charging the same allocation
+    if (!intel_hit)
+	__sync_fetch_and_add(&allocation->intel_misses, 1);
+    if (!hammerblade_hit)
+	__sync_fetch_and_add(&allocation->hammerblade_misses, 1);
 
-    CountInstruction(intel_hit, hammerblade_hit);
+    PIN_RWMutexUnlock(&allocation_lock);
 }
 
-static
-VOID StoreInstruction(ADDRINT write_addr, UINT32 write_size)
+/*
+ * miss_addr is the address of the first access of the instruction that
+ * missed in either model.
+ */
+static inline VOID ProfileMemop(UINT32 slot, ADDRINT miss_addr, bool intel_hit, bool hammerblade_hit)
 {
-    bool intel_hit, hammerblade_hit;
+    MEMOP_ENTRY &entry = profile[slot];
 
-    intel_hit = dl1_intel->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
-    hammerblade_hit = dl1->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+    __sync_fetch_and_add(&entry.intel[intel_hit ? COUNTER_HIT : COUNTER_MISS], 1);
+    __sync_fetch_and_add(&entry.hammerblade[hammerblade_hit ? COUNTER_HIT : COUNTER_MISS], 1);
 
-    CountInstruction(intel_hit, hammerblade_hit);
+    if (!(intel_hit && hammerblade_hit))
+	AttributeMiss(miss_addr, intel_hit, hammerblade_hit);
 }
 
-static
-VOID NonMemoryInstruction()
+/*
+ * operator new calls malloc, so only the outermost allocation function a
+ * thread is in records the allocation, with its caller as the site.
+ * Allocations made outside the region of interest are not tracked.
+ */
+static VOID AllocEnter(THREAD_DATA *td, ADDRINT size, ADDRINT site)
 {
-    CountInstruction(true, true);
+    if (!td || !roi_active)
+	return;
+
+    if (td->alloc_depth++ == 0) {
+	td->alloc_size = size;
+	td->alloc_site = site;
+    }
 }
 
-/* ===================================================================== */
+static VOID CallocEnter(THREAD_DATA *td, ADDRINT count, ADDRINT size, ADDRINT site)
+{
+    AllocEnter(td, count * size, site);
+}
 
-VOID Instruction(INS ins, void * v)
+static VOID AllocExit(THREAD_DATA *td, ADDRINT ptr)
 {
-    RTN rtn = INS_Rtn(ins);
-    if (!RTN_Valid(rtn))
+    if (!td || td->alloc_depth == 0 || --td->alloc_depth != 0)
 	return;
-    
-    if (!filter.SelectRtn(rtn))
-    	return;
-    
-    bool is_memory_read, is_memory_write;
 
-    is_memory_read  = INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins);
-    is_memory_write = INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins);
-    if (is_memory_read && is_memory_write) {
-	INS_InsertPredicatedCall(
-	    ins, IPOINT_BEFORE, (AFUNPTR) LoadStoreInstruction,
-	    IARG_MEMORYREAD_EA,
-	    IARG_MEMORYREAD_SIZE,
-	    IARG_MEMORYWRITE_EA,
-	    IARG_MEMORYWRITE_SIZE,
-	    IARG_END);	
-    } else if (is_memory_read) {
-	// for instructions that read
-	INS_InsertPredicatedCall(
-	    ins, IPOINT_BEFORE, (AFUNPTR) LoadInstruction,
-	    IARG_MEMORYREAD_EA,
-	    IARG_MEMORYREAD_SIZE,
-	    IARG_END);	
-    } else if (is_memory_write) {
-	// for instructions that write
-	INS_InsertPredicatedCall(
-	    ins, IPOINT_BEFORE, (AFUNPTR) StoreInstruction,
-	    IARG_MEMORYWRITE_EA,
-	    IARG_MEMORYWRITE_SIZE,
-	    IARG_END);
-    } else {
-	// for non memory instructions
-	INS_InsertPredicatedCall(
-	    ins, IPOINT_BEFORE, (AFUNPTR) NonMemoryInstruction,
-	    IARG_END);
-    }        
+    if (ptr == 0 || td->alloc_size < KnobAllocationMin.Value())
+	return;
+
+    ALLOCATION *allocation = new ALLOCATION();
+    allocation->start = ptr;
+    allocation->size = td->alloc_size;
+
+    PIN_LockClient();
+    allocation->site = Locate(td->alloc_site);
+    PIN_UnlockClient();
+
+    PIN_RWMutexWriteLock(&allocation_lock);
+    live_allocations[ptr] = allocation;
+    allocations.push_back(allocation);
+    PIN_RWMutexUnlock(&allocation_lock);
 }
 
-static void HBPintoolFini(int code, void *v)
+/*
+ * A tracked block freed outside the region of interest stays in
+ * live_allocations until its address is handed out again.
+ */
+static VOID FreeEnter(ADDRINT ptr)
 {
-    const int prefix_width = 16;
-    std::string hammerblade_prefix = "HammerBlade";
-    std::string xeon_prefix        = "Xeon E7-8894 v4";
-    
-    // instruction energy costs
-    double Xeon_JPInstruction = 5.7e-9; // 3 nops per cycle
-    double HammerBlade_JPInstruction = 5e-12;
+    if (!roi_active)
+	return;
 
-    // Xeon IPC = 1/2?
-    // Manycore IPC = 512 (or something?)
-    
-    // memory energy costs
-    //double DDR4_JPBit = 348e-12; // if we just stream
-    double DDR4_JPBit = 124.07e-12;
-    double HBM2_JPBit = 3.6e-12;
+    // most frees are of small blocks that were never tracked
+    PIN_RWMutexReadLock(&allocation_lock);
+    bool tracked = live_allocations.count(ptr) != 0;
+    PIN_RWMutexUnlock(&allocation_lock);
 
-    double Joules_hammerblade_insts = HammerBlade_JPInstruction * (hammerblade_icount[COUNTER_HIT]+hammerblade_icount[COUNTER_MISS]);
-    double Joules_hammerblade_membits = HBM2_JPBit * dl1->LineSize() * 8 * hammerblade_icount[COUNTER_MISS];
-    double Joules_hammerblade = Joules_hammerblade_insts + Joules_hammerblade_membits;           
+    if (tracked) {
+	PIN_RWMutexWriteLock(&allocation_lock);
+	live_allocations.erase(ptr);
+	PIN_RWMutexUnlock(&allocation_lock);
+    }
+}
 
-    double Joules_xeon_insts =  Xeon_JPInstruction * (intel_icount[COUNTER_HIT]+intel_icount[COUNTER_MISS]);
-    double Joules_xeon_membits = (DDR4_JPBit * INTEL_CACHELINE_SIZE * 8 * intel_icount[COUNTER_MISS]);
-    double Joules_xeon = Joules_xeon_insts + Joules_xeon_membits;             
+static VOID InsertAllocExit(RTN rtn)
+{
+    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR) AllocExit,
+		   IARG_REG_VALUE, thread_data_reg,
+		   IARG_FUNCRET_EXITPOINT_VALUE,
+		   IARG_END);
+}
 
-    // // performance
-    // double Time_DRAM_Xeon = 60e-9; // 60ns
-    // double Time_DRAM_Hammerblade = (0.116e-9)*16; // 0.116ns
-    
-    // outFile << std::setw(prefix_width) << hammerblade_prefix << " Estimated Performance: " << std::scientific << Time_DRAM_Hammerblade * hammerblade_icount[COUNTER_MISS] << "\n";
-    // outFile << std::setw(prefix_width) << xeon_prefix        << " Estimated Performance: " << std::scientific << Time_DRAM_Xeon * intel_icount[COUNTER_MISS]              << "\n";
-    // // IPC, HZ => Instructions / (IPC * HZ) = Seconds
-    // // Take Joules/Seconds
-    
-    // // outFile << std::setw(prefix_width) << hammerblade_prefix << ": "
-    // //         << "Instructions: " << std::scientific << (double) (hammerblade_icount[COUNTER_HIT]+hammerblade_icount[COUNTER_MISS]) << ", "
-    // //         << "DRAM Bits: "   << std::scientific << (double) (hammerblade_icount[COUNTER_MISS] * dl1->LineSize() * 8) << ", "
-    // //         << "Misses: "      << std::scientific << (double) (hammerblade_icount[COUNTER_MISS])
-    // //         << "\n";
+/*
+ * Wrap the allocator wherever it is defined. operator delete ends up in
+ * free, so free is all that needs to be watched for releases.
+ */
+VOID Image(IMG img, VOID *v)
+{
+    static const char *allocators[] = { "malloc", "_Znwm", "_Znam" };
 
-    // // outFile << std::setw(prefix_width) << xeon_prefix << ": "
-    // //         << "Instructions: " << std::scientific << (double) (intel_icount[COUNTER_HIT]+intel_icount[COUNTER_MISS]) << ", "
-    // //         << "DRAM Bits: "   << std::scientific << (double) (intel_icount[COUNTER_MISS] * INTEL_CACHELINE_SIZE * 8) << ", "
-    // //         << "Misses: "      << std::scientific << (double) (intel_icount[COUNTER_MISS])
-    // //         << "\n";
-    
-    // outFile << std::setw(prefix_width) << hammerblade_prefix << " Energy Cost: " << std::scientific << Joules_hammerblade << " J\n";
-    // // outFile << std::setw(prefix_width) << hammerblade_prefix << ": "
-    // //         << "Ins Energy Cost (%): "  << std::fixed << (Joules_hammerblade_insts/Joules_hammerblade)*100 << ", "
-    // //         << "Mem Energy Cost (%): "  << std::fixed << (Joules_hammerblade_membits/Joules_hammerblade)*100
-    // //         << "\n";
-    
-    
-    // outFile << std::setw(prefix_width) << xeon_prefix << " Energy Cost: " << std::scientific << Joules_xeon << " J\n";
-    // // outFile << std::setw(prefix_width) << xeon_prefix << ": "
-    // //         << "Ins Energy Cost (%): " << std::fixed << ((double)Joules_xeon_insts/Joules_xeon)*100 << ", "
-    // //         << "Mem Energy Cost (%): " << std::fixed << ((double)Joules_xeon_membits/Joules_xeon)*100
-    // //         << "\n";
+    for (UINT32 i = 0; i < array_size(allocators); i++) {
+	RTN rtn = RTN_FindByName(img, allocators[i]);
+	if (!RTN_Valid(rtn))
+	    continue;
 
-    double hammerblade_gop = (hammerblade_icount[COUNTER_HIT] + hammerblade_icount[COUNTER_MISS])/1e9;
-    double intel_gop       = (intel_icount[COUNTER_HIT] + intel_icount[COUNTER_MISS])/1e9;
-    
-    outFile << std::setw(prefix_width) << hammerblade_prefix << ": "
-            << std::scientific << hammerblade_gop / Joules_hammerblade << " GOPS/Watt\n";
+	RTN_Open(rtn);
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) AllocEnter,
+		       IARG_REG_VALUE, thread_data_reg,
+		       IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+		       IARG_RETURN_IP,
+		       IARG_END);
+	InsertAllocExit(rtn);
+	RTN_Close(rtn);
+    }
 
-    outFile << std::setw(prefix_width) << xeon_prefix << ": "
-            << std::scientific <<  intel_gop / Joules_xeon << " GOPS/Watt\n";
-    
-    // outFile << "Energy Cost Ratio (" << xeon_prefix << "/" << hammerblade_prefix << "): " << std::fixed << Joules_xeon/Joules_hammerblade << "\n";
+    RTN rtn = RTN_FindByName(img, "calloc");
+    if (RTN_Valid(rtn)) {
+	RTN_Open(rtn);
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) CallocEnter,
+		       IARG_REG_VALUE, thread_data_reg,
+		       IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+		       IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+		       IARG_RETURN_IP,
+		       IARG_END);
+	InsertAllocExit(rtn);
+	RTN_Close(rtn);
+    }
+
+    // realloc releases its first argument and allocates its second
+    rtn = RTN_FindByName(img, "realloc");
+    if (RTN_Valid(rtn)) {
+	RTN_Open(rtn);
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) FreeEnter,
+		       IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+		       IARG_END);
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) AllocEnter,
+		       IARG_REG_VALUE, thread_data_reg,
+		       IARG_FUNCARG_ENTRYPOINT_VALUE, 1,
+		       IARG_RETURN_IP,
+		       IARG_END);
+	InsertAllocExit(rtn);
+	RTN_Close(rtn);
+    }
+
+    rtn = RTN_FindByName(img, "free");
+    if (RTN_Valid(rtn)) {
+	RTN_Open(rtn);
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) FreeEnter,
+		       IARG_FUNCARG_ENTRYPOINT_VALUE, 0,
+		       IARG_END);
+	RTN_Close(rtn);
+    }
 }
 
-VOID Fini(int code, VOID * v)
+/*
+ * Profile slot of a memory instruction, or NO_SLOT if -tl/-ts do not
+ * select it. Called at instrumentation time.
+ */
+static UINT32 ProfileSlot(INS ins, bool is_memory_read, bool is_memory_write)
 {
-    // OriginalFini(code, v);
-    HBPintoolFini(code, v);
-    outFile.close();
+    if (!(is_memory_read && KnobTrackLoads.Value())
+	&& !(is_memory_write && KnobTrackStores.Value()))
+	return MEMOP_PROFILE::NO_SLOT;
+
+    const UINT32 slot = profile.Slot(INS_Address(ins));
+    if (slot == memop_sources.size())
+	memop_sources.push_back(Locate(INS_Address(ins)));
+
+    return slot;
 }
+
 /* ===================================================================== */
-/* Main                                                                  */
+/* Cache sweep (-sweep)                                                  */
 /* ===================================================================== */
 
+static inline VOID SweepAccess(THREAD_DATA *td, ADDRINT addr, UINT32 size)
+{
+    for (UINT32 i = 0; i < td->sweeps.size(); i++)
+	td->sweeps[i]->Access(addr, size);
+}
 
-int main(int argc, char *argv[])
+static inline VOID SweepRetire(THREAD_DATA *td)
 {
-    PIN_InitSymbols();
+    for (UINT32 i = 0; i < td->sweeps.size(); i++)
+	td->sweeps[i]->Retire();
+}
 
-    if( PIN_Init(argc,argv) )
-    {
-        return Usage();
+/*
+ * Direct mode; a size of 0 means the instruction has no such access. In
+ * -buffer mode SimulateBuffer feeds the sweeps itself.
+ */
+static VOID SweepMemop(THREAD_DATA *td,
+		       ADDRINT read_addr,  UINT32 read_size,
+		       ADDRINT write_addr, UINT32 write_size)
+{
+    if (read_size)
+	SweepAccess(td, read_addr, read_size);
+    if (write_size)
+	SweepAccess(td, write_addr, write_size);
+    SweepRetire(td);
+}
+
+/* Sets for every grid point from min_kb to max_kb, down to MAX_WAYS ways */
+static SWEEP_CONFIG SweepConfig(UINT32 line_size, UINT32 min_kb, UINT32 max_kb)
+{
+    SWEEP_CONFIG config;
+
+    config.line_size = line_size;
+    config.min_sets = std::max(min_kb * KILO / (line_size * CACHE_SWEEP::MAX_WAYS), 1u);
+    config.max_sets = (UINT64) max_kb * KILO / line_size;
+    return config;
+}
+
+/* Bytes of set stacks one thread's sweeps need */
+static UINT64 SweepBytes(const std::vector<SWEEP_CONFIG> &configs)
+{
+    UINT64 bytes = 0;
+
+    for (UINT32 i = 0; i < configs.size(); i++) {
+	for (UINT32 sets = configs[i].min_sets; sets <= configs[i].max_sets; sets *= 2)
+	    bytes += (UINT64) sets * CACHE_SWEEP::MAX_WAYS * sizeof(ADDRINT);
     }
+    return bytes;
+}
 
-    outFile.open(KnobOutputFile.Value().c_str());
+/*
+ * Threads the program is expected to run, to size the per-thread sweeps
+ * by: OMP_NUM_THREADS if set, otherwise one per processor as OpenMP does
+ */
+static UINT32 ExpectedThreads()
+{
+    const char *omp = getenv("OMP_NUM_THREADS");
+    long threads = omp ? atol(omp) : sysconf(_SC_NPROCESSORS_ONLN);
 
-    dl1_intel = new DL1::CACHE_INTEL("L1 Data Cache",
-				     INTEL_CACHE_SIZE, // size
-				     INTEL_CACHELINE_SIZE, // block size
-				     INTEL_ASSOCIATIVITY); // associativity
-    
-    ResetDl1();   
+    return threads > 0 ? threads : 1;
+}
 
-    RTN_AddInstrumentFunction(Routine, NULL);
-    
-    // profile.SetKeyName("iaddr          ");
-    // profile.SetCounterName("dcache:miss        dcache:hit");
+/* ===================================================================== */
+/* Sampled simulation (-sample_period)                                   */
+/*                                                                       */
+/* Every thread cycles through the SAMPLE_PHASEs by its own instruction  */
+/* count, checked inline at the start of each basic block. Fast forward  */
+/* only marks the touched lines in the never-evicting HammerBlade cache  */
+/* (or skips the memops altogether with -sample_functional_warm 0),      */
+/* warm runs both caches without counting and without feeding the HBM   */
+/* model, detailed is a normal simulation.                               */
+/* At Fini the misses of the detailed windows are extrapolated to all    */
+/* instructions with a ratio estimator.                                  */
+/* ===================================================================== */
 
-    COUNTER_HIT_MISS threshold;
+static SAMPLE_WINDOW SampleCounts(const THREAD_DATA *td)
+{
+    SAMPLE_WINDOW counts = {
+	td->Instructions(),
+	td->hammerblade_icount[COUNTER_MISS],
+	td->intel_icount[COUNTER_MISS]
+    };
+    return counts;
+}
 
-    threshold[COUNTER_HIT] = KnobThresholdHit.Value();
-    threshold[COUNTER_MISS] = KnobThresholdMiss.Value();
-    
-    // profile.SetThreshold( threshold );
+static VOID CloseWindow(THREAD_DATA *td)
+{
+    const SAMPLE_WINDOW now = SampleCounts(td);
+    SAMPLE_WINDOW window = {
+	now.instructions - td->window_start.instructions,
+	now.hammerblade_misses - td->window_start.hammerblade_misses,
+	now.intel_misses - td->window_start.intel_misses
+    };
+
+    if (window.instructions) {
+	td->windows.push_back(window);
+	td->sampled.instructions += window.instructions;
+	td->sampled.hammerblade_misses += window.hammerblade_misses;
+	td->sampled.intel_misses += window.intel_misses;
+    }
+}
 
-    filter.Activate();
-    
-    INS_AddInstrumentFunction(Instruction, 0);
+static VOID EnterPhase(THREAD_DATA *td, UINT32 phase)
+{
+    // the Xeon model never saw the last line of a functional warmup
+    if (td->sample_phase == SAMPLE_FAST_FORWARD)
+	td->last_line = ~(ADDRINT)0;
+
+    td->sample_phase = phase;
+    td->phase_end += sample_length[phase];
+    td->simulate_mask = phase == SAMPLE_FAST_FORWARD && !KnobSampleFunctionalWarm.Value() ? 0 : ~(ADDRINT)0;
+
+    // warming fills the caches but counts neither HBM traffic nor prefetches
+    if (phase == SAMPLE_WARM) {
+	td->dl1->SetMissCallback(0, 0);
+	td->dl1->SetPrefetcher(NULL);
+	td->dl1_intel->SetPrefetcher(NULL);
+    } else if (phase == SAMPLE_DETAILED) {
+	td->dl1->SetMissCallback(HBM_MODEL::MissCallback, &td->hbm);
+	td->dl1->SetPrefetcher(td->hb_prefetcher);
+	td->dl1_intel->SetPrefetcher(td->xeon_prefetcher);
+	td->window_start = SampleCounts(td);
+    }
+}
+
+static VOID StartSampling(THREAD_DATA *td)
+{
+    td->phase_end = 0;
+    EnterPhase(td, SAMPLE_FAST_FORWARD);
+}
+
+static
+ADDRINT PIN_FAST_ANALYSIS_CALL IfPhaseOver(THREAD_DATA *td)
+{
+    return td->Instructions() >= td->phase_end;
+}
+
+static
+VOID PIN_FAST_ANALYSIS_CALL NextPhase(THREAD_DATA *td)
+{
+    // a long basic block may run past a whole phase
+    while (td->Instructions() >= td->phase_end) {
+	if (td->sample_phase == SAMPLE_DETAILED)
+	    CloseWindow(td);
+
+	UINT32 next = td->sample_phase;
+	do
+	    next = (next + 1) % SAMPLE_NUM;
+	while (sample_length[next] == 0);
+
+	EnterPhase(td, next);
+    }
+}
+
+static
+ADDRINT PIN_FAST_ANALYSIS_CALL IfSimulating(THREAD_DATA *td)
+{
+    return td->simulate_mask;
+}
+
+/*
+ * Functional warmup while fast forwarding. Lines first touched here would
+ * otherwise count as cold misses in every later window, since the
+ * HammerBlade model never evicts them; the Xeon's LRU state is left to
+ * -sample_warm.
+ */
+static inline
+VOID WarmHammerblade(THREAD_DATA *td, ADDRINT addr, UINT32 size, CACHE_BASE::ACCESS_TYPE type)
+{
+    td->dl1->Warm(addr, size, type);
+    td->last_line = (addr + size - 1) >> last_line_shift;
+}
+
+/*
+ * Ratio estimate of the misses of the sampled threads' instructions.
+ * The windows are treated as a simple random sample of all windows.
+ */
+struct SAMPLE_ESTIMATE
+{
+    UINT64 windows;
+    UINT64 detailed;		// instructions in detailed windows
+    UINT64 instructions;	// all instructions
+    double hammerblade_misses, hammerblade_error;	// error is the 95% half width
+    double intel_misses, intel_error;
+};
+
+static VOID EstimateMisses(const std::vector<SAMPLE_WINDOW> &windows, UINT64 instructions,
+			   SAMPLE_ESTIMATE &estimate)
+{
+    const double z95 = 1.96;
+    double misses[2] = { 0, 0 };
+    double errors[2] = { 0, 0 };
+    UINT64 detailed = 0;
+
+    for (UINT32 i = 0; i < windows.size(); i++)
+	detailed += windows[i].instructions;
+
+    for (UINT32 model = 0; model < 2 && detailed; model++) {
+	double sampled = 0;
+
+	for (UINT32 i = 0; i < windows.size(); i++)
+	    sampled += model == 0 ? windows[i].hammerblade_misses : windows[i].intel_misses;
+
+	const double rate = sampled / detailed;
+	misses[model] = rate * instructions;
+
+	if (windows.size() < 2)
+	    continue;
+
+	double residuals = 0;
+	for (UINT32 i = 0; i < windows.size(); i++) {
+	    double m = model == 0 ? windows[i].hammerblade_misses : windows[i].intel_misses;
+	    double r = m - rate * windows[i].instructions;
+	    residuals += r * r;
+	}
+
+	const double n = windows.size();
+	const double mean = detailed / n;
+	const double unsampled = 1.0 - std::min((double) detailed / instructions, 1.0);
+	const double rate_variance = unsampled * residuals / (n - 1) / (n * mean * mean);
+
+	errors[model] = z95 * sqrt(rate_variance) * instructions;
+    }
+
+    estimate.windows = windows.size();
+    estimate.detailed = detailed;
+    estimate.instructions = instructions;
+    estimate.hammerblade_misses = misses[0];
+    estimate.hammerblade_error = errors[0];
+    estimate.intel_misses = misses[1];
+    estimate.intel_error = errors[1];
+}
+
+/* Replace the counted misses by their estimate */
+static VOID Extrapolate(const SAMPLE_ESTIMATE &estimate, UINT64 *hammerblade_icount, UINT64 *intel_icount)
+{
+    hammerblade_icount[COUNTER_MISS] = (UINT64) (estimate.hammerblade_misses + 0.5);
+    hammerblade_icount[COUNTER_HIT] = estimate.instructions - hammerblade_icount[COUNTER_MISS];
+    intel_icount[COUNTER_MISS] = (UINT64) (estimate.intel_misses + 0.5);
+    intel_icount[COUNTER_HIT] = estimate.instructions - intel_icount[COUNTER_MISS];
+}
+
+/* ===================================================================== */
+/* Trace capture (-trace_out)                                            */
+/*                                                                       */
+/* Every simulated memop is also appended to its thread's TRACE_WRITER,  */
+/* stamped with the thread's instruction count so far. The inline        */
+/* last-line filter is off while tracing so that the trace holds every   */
+/* access and hbreplay can model caches with other line sizes.           */
+/* ===================================================================== */
+
+static VOID WriteTraceChunk(const TRACE_CHUNK_HEADER &header, const UINT8 *records, VOID *arg)
+{
+    const THREAD_DATA *td = static_cast<const THREAD_DATA*>(arg);
+
+    PIN_GetLock(&trace_lock, td->tid + 1);
+    trace_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    trace_file.write(reinterpret_cast<const char*>(records), TracePadded(header.bytes));
+    PIN_ReleaseLock(&trace_lock);
+}
+
+static inline VOID TraceMemop(THREAD_DATA *td,
+			      ADDRINT read_addr,  UINT32 read_size,
+			      ADDRINT write_addr, UINT32 write_size)
+{
+    td->trace->Memop(td->hammerblade_icount[COUNTER_HIT] + td->hammerblade_icount[COUNTER_MISS],
+		     read_addr, read_size, write_addr, write_size);
+}
+
+/*
+ * Write out the instructions since the thread's last memop and its last
+ * chunk. Called at thread exit and, for threads still running, at Fini.
+ */
+static VOID FinishTrace(THREAD_DATA *td)
+{
+    if (!td->trace)
+	return;
+
+    td->trace->Mark(td->hammerblade_icount[COUNTER_HIT] + td->hammerblade_icount[COUNTER_MISS],
+		    TRACE_MARK_INSTRUCTIONS);
+    td->trace->Flush();
+    delete td->trace;
+    td->trace = NULL;
+}
+
+/* ===================================================================== */
+/* Buffered simulation                                                   */
+/*                                                                       */
+/* With -buffer the application threads only append MEMREF records to a  */
+/* Pin trace buffer. Full buffers are queued for an internal simulation  */
+/* thread that runs the owning thread's cache models in batches and      */
+/* hands the buffer back to that thread's ring once it is done.          */
+/* ===================================================================== */
+
+struct FULL_BUFFER
+{
+    THREAD_DATA *td;
+    MEMREF *refs;
+    UINT64 num_refs;
+};
+
+BUFFER_ID memref_buffer;
+
+PIN_LOCK buffer_lock;                  // guards full_buffers and all free lists
+PIN_SEMAPHORE buffer_full_sem;         // set while full_buffers is not empty
+std::deque<FULL_BUFFER> full_buffers;
+
+PIN_LOCK sim_lock;                     // held while the cache models run
+PIN_THREAD_UID sim_thread_uid;
+volatile bool sim_exiting = false;
+
+static inline VOID RetirePending(THREAD_DATA *td)
+{
+    if (td->pending_slot != MEMOP_PROFILE::NO_SLOT) {
+	ProfileMemop(td->pending_slot, td->pending_miss_addr,
+		     td->pending_intel_hit, td->pending_hammerblade_hit);
+	td->pending_slot = MEMOP_PROFILE::NO_SLOT;
+    }
+    // the application thread is still adding to its icounts
+    td->buffered_intel_misses += !td->pending_intel_hit;
+    td->buffered_hammerblade_misses += !td->pending_hammerblade_hit;
+    td->pending_intel_hit = td->pending_hammerblade_hit = true;
+}
+
+/* Called at Fini, after BufferPrepareForFini has joined the simulation thread */
+static VOID FoldBufferedMisses(THREAD_DATA *td)
+{
+    td->intel_icount[COUNTER_HIT] -= td->buffered_intel_misses;
+    td->intel_icount[COUNTER_MISS] += td->buffered_intel_misses;
+    td->hammerblade_icount[COUNTER_HIT] -= td->buffered_hammerblade_misses;
+    td->hammerblade_icount[COUNTER_MISS] += td->buffered_hammerblade_misses;
+    td->buffered_intel_misses = td->buffered_hammerblade_misses = 0;
+}
+
+static VOID SimulateBuffer(THREAD_DATA *td, const MEMREF *refs, UINT64 num_refs)
+{
+    td->CheckEpoch();
+
+    for (const MEMREF *ref = refs; ref != refs + num_refs; ref++) {
+	CACHE_BASE::ACCESS_TYPE type = CACHE_BASE::ACCESS_TYPE_STORE;
+
+	switch (ref->type) {
+	case MEMREF_LOAD:
+	    type = CACHE_BASE::ACCESS_TYPE_LOAD;
+	    RetirePending(td);
+	    SweepRetire(td);
+	    td->pending_slot = ref->slot;
+	    break;
+	case MEMREF_STORE:
+	    RetirePending(td);
+	    SweepRetire(td);
+	    td->pending_slot = ref->slot;
+	    break;
+	}
+
+	SweepAccess(td, ref->addr, ref->size);
+
+	bool intel_hit = td->dl1_intel->Access(ref->addr, ref->size, type);
+	bool hammerblade_hit = td->dl1->Access(ref->addr, ref->size, type);
+
+	if (td->pending_intel_hit && td->pending_hammerblade_hit)
+	    td->pending_miss_addr = ref->addr;
+	td->pending_intel_hit &= intel_hit;
+	td->pending_hammerblade_hit &= hammerblade_hit;
+    }
+}
+
+/*
+ * Simulate every queued buffer. Called by the simulation thread and, in
+ * case it has already exited, by the thread fini callback.
+ */
+static VOID DrainBuffers(INT32 owner)
+{
+    PIN_GetLock(&sim_lock, owner);
+    for (;;) {
+	PIN_GetLock(&buffer_lock, owner);
+	if (full_buffers.empty()) {
+	    PIN_SemaphoreClear(&buffer_full_sem);
+	    PIN_ReleaseLock(&buffer_lock);
+	    break;
+	}
+	FULL_BUFFER full = full_buffers.front();
+	full_buffers.pop_front();
+	PIN_ReleaseLock(&buffer_lock);
+
+	SimulateBuffer(full.td, full.refs, full.num_refs);
+
+	PIN_GetLock(&buffer_lock, owner);
+	full.td->free_buffers.push_back(full.refs);
+	PIN_SemaphoreSet(&full.td->buffer_free_sem);
+	PIN_ReleaseLock(&buffer_lock);
+    }
+    PIN_ReleaseLock(&sim_lock);
+}
+
+static VOID SimulationThread(VOID *arg)
+{
+    while (!sim_exiting) {
+	PIN_SemaphoreWait(&buffer_full_sem);
+	DrainBuffers(-1);
+    }
+}
+
+static VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt,
+			 VOID *buf, UINT64 num_elements, VOID *v)
+{
+    THREAD_DATA *td = static_cast<THREAD_DATA*>(PIN_GetThreadData(thread_data_key, tid));
+    FULL_BUFFER full = { td, static_cast<MEMREF*>(buf), num_elements };
+
+    PIN_GetLock(&buffer_lock, tid + 1);
+    full_buffers.push_back(full);
+    PIN_SemaphoreSet(&buffer_full_sem);
+
+    // block until the simulation thread gives one of our buffers back
+    while (td->free_buffers.empty()) {
+	PIN_SemaphoreClear(&td->buffer_free_sem);
+	PIN_ReleaseLock(&buffer_lock);
+	PIN_SemaphoreWait(&td->buffer_free_sem);
+	PIN_GetLock(&buffer_lock, tid + 1);
+    }
+    MEMREF *next = td->free_buffers.back();
+    td->free_buffers.pop_back();
+    PIN_ReleaseLock(&buffer_lock);
+
+    return next;
+}
+
+static VOID BufferPrepareForFini(VOID *v)
+{
+    sim_exiting = true;
+    PIN_SemaphoreSet(&buffer_full_sem);
+    PIN_WaitForThreadTermination(sim_thread_uid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+/* ===================================================================== */
+/* Thread callbacks                                                      */
+/* ===================================================================== */
+
+static VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    ASSERT(tid < max_threads, "Too many threads\n");
+
+    THREAD_DATA *td = new THREAD_DATA(tid);
+
+    if (tracing)
+	td->trace = new TRACE_WRITER(tid, KnobTraceChunkKB.Value() * KILO, WriteTraceChunk, td);
+    if (sampling)
+	StartSampling(td);
+
+    if (KnobBuffer.Value()) {
+	// Pin hands the thread its first buffer itself
+	for (UINT32 i = 1; i < std::max(KnobBufferCount.Value(), 2u); i++)
+	    td->free_buffers.push_back(static_cast<MEMREF*>(PIN_AllocateBuffer(memref_buffer)));
+	PIN_SemaphoreSet(&td->buffer_free_sem);
+    }
+
+    PIN_SetThreadData(thread_data_key, td, tid);
+    PIN_SetContextReg(ctxt, thread_data_reg, reinterpret_cast<ADDRINT>(td));
+
+    // thread callbacks are serialized by Pin
+    thread_data[tid] = td;
+    if (tid >= num_threads)
+	num_threads = tid + 1;
+}
+
+static VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    if (KnobBuffer.Value()) {
+	// Pin has queued this thread's last buffer; simulate it before the
+	// buffer goes away with the thread
+	DrainBuffers(tid + 1);
+	THREAD_DATA *td = static_cast<THREAD_DATA*>(PIN_GetThreadData(thread_data_key, tid));
+	RetirePending(td);
+	SweepRetire(td);
+    }
+
+    FinishTrace(static_cast<THREAD_DATA*>(PIN_GetThreadData(thread_data_key, tid)));
+}
+
+/* ===================================================================== */
+/* Region of interest and kernels                                        */
+/* ===================================================================== */
+
+static VOID SetRoi(THREADID tid, bool active)
+{
+    PIN_GetLock(&roi_lock, tid + 1);
+    bool changed = roi_active != active;
+    if (changed) {
+	roi_active = active;
+	if (active)
+	    roi_entries++;
+    }
+    PIN_ReleaseLock(&roi_lock);
+
+    // the running trace finishes with its old instrumentation
+    if (changed)
+	PIN_RemoveInstrumentation();
+}
+
+static VOID RoiStart(THREADID tid)
+{
+    SetRoi(tid, true);
+}
+
+static VOID RoiStop(THREADID tid)
+{
+    SetRoi(tid, false);
+}
+
+static VOID FindRoiRoutines(IMG img, const KNOB<string> &knob, std::set<ADDRINT> &addrs)
+{
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++) {
+	if (knob.Value(i).empty())
+	    continue;
+
+	RTN rtn = RTN_FindByName(img, knob.Value(i).c_str());
+	if (RTN_Valid(rtn))
+	    addrs.insert(RTN_Address(rtn));
+    }
+}
+
+VOID RoiImage(IMG img, VOID *v)
+{
+    FindRoiRoutines(img, KnobRoiStart, roi_start_addrs);
+    FindRoiRoutines(img, KnobRoiStop, roi_stop_addrs);
+}
+
+/* xchg of a register with itself, a no-op the program uses as a marker */
+static bool IsMagic(INS ins, REG reg)
+{
+    return KnobRoiMagic.Value() && INS_IsXchg(ins)
+	&& INS_OperandIsReg(ins, 0) && INS_OperandReg(ins, 0) == reg
+	&& INS_OperandIsReg(ins, 1) && INS_OperandReg(ins, 1) == reg;
+}
+
+/*
+ * The markers are instrumented in and out of the region, wherever they
+ * are; -filter_rtn only applies to the simulation.
+ */
+static VOID InstrumentRoiMarkers(TRACE trace)
+{
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+	for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+	    if (roi_start_addrs.count(INS_Address(ins)) || IsMagic(ins, REG_BX))
+		INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) RoiStart,
+			       IARG_THREAD_ID, IARG_END);
+	    else if (roi_stop_addrs.count(INS_Address(ins)) || IsMagic(ins, REG_CX))
+		INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) RoiStop,
+			       IARG_THREAD_ID, IARG_END);
+	}
+    }
+}
+
+static KERNEL_STATS KernelCounts(const THREAD_DATA *td)
+{
+    KERNEL_STATS counts = {
+	0,
+	td->Instructions(),
+	td->HammerbladeMisses(),
+	td->IntelMisses()
+    };
+    return counts;
+}
+
+/*
+ * A kernel called from inside a kernel counts towards the outer one.
+ * Calls that start outside the region of interest are not counted.
+ */
+static VOID KernelEnter(THREAD_DATA *td, UINT32 kernel)
+{
+    if (!roi_active || td->kernel_depth++ > 0)
+	return;
+
+    td->kernel = kernel;
+    td->kernel_start = KernelCounts(td);
+}
+
+static VOID KernelExit(THREAD_DATA *td)
+{
+    if (td->kernel_depth == 0 || --td->kernel_depth > 0)
+	return;
+
+    const KERNEL_STATS now = KernelCounts(td);
+    KERNEL_STATS &stats = td->kernel_stats[td->kernel];
+
+    stats.calls++;
+    stats.instructions += now.instructions - td->kernel_start.instructions;
+    stats.hammerblade_misses += now.hammerblade_misses - td->kernel_start.hammerblade_misses;
+    stats.intel_misses += now.intel_misses - td->kernel_start.intel_misses;
+}
+
+static VOID InstrumentKernel(RTN rtn)
+{
+    std::vector<std::string>::const_iterator it = std::find(kernels.begin(), kernels.end(), RTN_Name(rtn));
+    if (it == kernels.end())
+	return;
+
+    RTN_Open(rtn);
+    RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) KernelEnter,
+		   IARG_REG_VALUE, thread_data_reg,
+		   IARG_UINT32, (UINT32) (it - kernels.begin()),
+		   IARG_END);
+    RTN_InsertCall(rtn, IPOINT_AFTER, (AFUNPTR) KernelExit,
+		   IARG_REG_VALUE, thread_data_reg,
+		   IARG_END);
+    RTN_Close(rtn);
+}
+
+/* ===================================================================== */
+
+void Routine(RTN rtn, void *v)
+{
+    InstrumentKernel(rtn);
+
+    if (!filter.SelectRtn(rtn))
+	return;
+    
+    // reset dl1 every time an epoch marker is called
+    if (epoch_markers.count(RTN_Name(rtn))) {
+	RTN_Open(rtn);
+	RTN_InsertCall(rtn, IPOINT_BEFORE, (AFUNPTR) ResetDl1,
+		       IARG_THREAD_ID, IARG_END);
+	RTN_Close(rtn);
+    }	
+}
+
+static
+VOID CountInstruction(THREAD_DATA *td, bool intel_hit, bool hammerblade_hit)
+{
+    td->intel_icount[intel_hit ? COUNTER_HIT : COUNTER_MISS]++;
+    td->hammerblade_icount[hammerblade_hit ? COUNTER_HIT : COUNTER_MISS]++;
+}
+
+static
+VOID LoadStoreInstruction(THREAD_DATA *td, UINT32 slot,
+			  ADDRINT read_addr,  UINT32 read_size,
+			  ADDRINT write_addr, UINT32 write_size)
+{
+    bool intel_hit, hammerblade_hit;
+    ADDRINT miss_addr = read_addr;
+
+    td->CheckEpoch();
+
+    intel_hit = td->dl1_intel->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+    hammerblade_hit = td->dl1->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+    if (intel_hit && hammerblade_hit)
+	miss_addr = write_addr;
+
+    intel_hit &= td->dl1_intel->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+    hammerblade_hit &= td->dl1->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+
+    CountInstruction(td, intel_hit, hammerblade_hit);
+    if (slot != MEMOP_PROFILE::NO_SLOT)
+	ProfileMemop(slot, miss_addr, intel_hit, hammerblade_hit);
+    if (!sweep_configs.empty())
+	SweepMemop(td, read_addr, read_size, write_addr, write_size);
+    if (td->trace)
+	TraceMemop(td, read_addr, read_size, write_addr, write_size);
+}
+
+static
+VOID LoadInstruction(THREAD_DATA *td, UINT32 slot, ADDRINT read_addr, UINT32 read_size)
+{
+    bool intel_hit, hammerblade_hit;
+
+    td->CheckEpoch();
+
+    intel_hit = td->dl1_intel->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+    hammerblade_hit = td->dl1->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+
+    CountInstruction(td, intel_hit, hammerblade_hit);
+    if (slot != MEMOP_PROFILE::NO_SLOT)
+	ProfileMemop(slot, read_addr, intel_hit, hammerblade_hit);
+    if (!sweep_configs.empty())
+	SweepMemop(td, read_addr, read_size, 0, 0);
+    if (td->trace)
+	TraceMemop(td, read_addr, read_size, 0, 0);
+}
+
+static
+VOID StoreInstruction(THREAD_DATA *td, UINT32 slot, ADDRINT write_addr, UINT32 write_size)
+{
+    bool intel_hit, hammerblade_hit;
+
+    td->CheckEpoch();
+
+    intel_hit = td->dl1_intel->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+    hammerblade_hit = td->dl1->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+
+    CountInstruction(td, intel_hit, hammerblade_hit);
+    if (slot != MEMOP_PROFILE::NO_SLOT)
+	ProfileMemop(slot, write_addr, intel_hit, hammerblade_hit);
+    if (!sweep_configs.empty())
+	SweepMemop(td, 0, 0, write_addr, write_size);
+    if (td->trace)
+	TraceMemop(td, 0, 0, write_addr, write_size);
+}
+
+static
+VOID NonMemoryInstruction(THREAD_DATA *td)
+{
+    CountInstruction(td, true, true);
+}
+
+/* ===================================================================== */
+/* Basic block counting analysis routines                                */
+/*                                                                       */
+/* Every instruction is counted as a hit by its basic block; the memory  */
+/* routines below move it to the miss counter when an access misses.     */
+/* ===================================================================== */
+
+static
+VOID PIN_FAST_ANALYSIS_CALL CountBbl(THREAD_DATA *td, UINT32 num_ins)
+{
+    td->intel_icount[COUNTER_HIT] += num_ins;
+    td->hammerblade_icount[COUNTER_HIT] += num_ins;
+}
+
+static
+VOID PIN_FAST_ANALYSIS_CALL CountPredicated(THREAD_DATA *td)
+{
+    td->intel_icount[COUNTER_HIT]++;
+    td->hammerblade_icount[COUNTER_HIT]++;
+}
+
+static inline
+VOID RecountMiss(THREAD_DATA *td, bool intel_hit, bool hammerblade_hit)
+{
+    if (!intel_hit) {
+	td->intel_icount[COUNTER_HIT]--;
+	td->intel_icount[COUNTER_MISS]++;
+    }
+    if (!hammerblade_hit) {
+	td->hammerblade_icount[COUNTER_HIT]--;
+	td->hammerblade_icount[COUNTER_MISS]++;
+    }
+}
+
+/*
+ * Inlined fast path: nonzero unless the access lies entirely within
+ * last_line or the thread is fast forwarding. The cache models' own hit
+ * statistics are not updated for the filtered hits, only the instruction
+ * counters used for the report. After an epoch marker last_line is gone
+ * from the reset cache, so the access goes on to CheckEpoch.
+ */
+static
+ADDRINT PIN_FAST_ANALYSIS_CALL IfNotLastLine(THREAD_DATA *td, ADDRINT addr, UINT32 size)
+{
+    return (((addr >> last_line_shift) ^ td->last_line)
+	    | (((addr + size - 1) >> last_line_shift) ^ td->last_line)
+	    | (td->epoch ^ hammerblade_epoch)) & td->simulate_mask;
+}
+
+static
+VOID PIN_FAST_ANALYSIS_CALL LoadInstructionBbl(THREAD_DATA *td, UINT32 slot, ADDRINT read_addr, UINT32 read_size)
+{
+    bool intel_hit, hammerblade_hit;
+
+    td->CheckEpoch();
+
+    if (td->sample_phase == SAMPLE_FAST_FORWARD) {
+	WarmHammerblade(td, read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+	return;
+    }
+
+    intel_hit = td->dl1_intel->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+    hammerblade_hit = td->dl1->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+
+    td->last_line = (read_addr + read_size - 1) >> last_line_shift;
+    if (td->sample_phase == SAMPLE_WARM)
+	return;
+
+    RecountMiss(td, intel_hit, hammerblade_hit);
+    if (slot != MEMOP_PROFILE::NO_SLOT)
+	ProfileMemop(slot, read_addr, intel_hit, hammerblade_hit);
+    if (!sweep_configs.empty())
+	SweepMemop(td, read_addr, read_size, 0, 0);
+    if (td->trace)
+	TraceMemop(td, read_addr, read_size, 0, 0);
+}
+
+static
+VOID PIN_FAST_ANALYSIS_CALL StoreInstructionBbl(THREAD_DATA *td, UINT32 slot, ADDRINT write_addr, UINT32 write_size)
+{
+    bool intel_hit, hammerblade_hit;
+
+    td->CheckEpoch();
+
+    if (td->sample_phase == SAMPLE_FAST_FORWARD) {
+	WarmHammerblade(td, write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+	return;
+    }
+
+    intel_hit = td->dl1_intel->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+    hammerblade_hit = td->dl1->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+
+    td->last_line = (write_addr + write_size - 1) >> last_line_shift;
+    if (td->sample_phase == SAMPLE_WARM)
+	return;
+
+    RecountMiss(td, intel_hit, hammerblade_hit);
+    if (slot != MEMOP_PROFILE::NO_SLOT)
+	ProfileMemop(slot, write_addr, intel_hit, hammerblade_hit);
+    if (!sweep_configs.empty())
+	SweepMemop(td, 0, 0, write_addr, write_size);
+    if (td->trace)
+	TraceMemop(td, 0, 0, write_addr, write_size);
+}
+
+static
+VOID PIN_FAST_ANALYSIS_CALL LoadStoreInstructionBbl(THREAD_DATA *td, UINT32 slot,
+						    ADDRINT read_addr,  UINT32 read_size,
+						    ADDRINT write_addr, UINT32 write_size)
+{
+    bool intel_hit, hammerblade_hit;
+    ADDRINT miss_addr = read_addr;
+
+    td->CheckEpoch();
+
+    if (td->sample_phase == SAMPLE_FAST_FORWARD) {
+	td->dl1->Warm(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+	WarmHammerblade(td, write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+	return;
+    }
+
+    intel_hit = td->dl1_intel->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+    hammerblade_hit = td->dl1->Access(read_addr, read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+    if (intel_hit && hammerblade_hit)
+	miss_addr = write_addr;
+
+    intel_hit &= td->dl1_intel->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+    hammerblade_hit &= td->dl1->Access(write_addr, write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+
+    td->last_line = (write_addr + write_size - 1) >> last_line_shift;
+    if (td->sample_phase == SAMPLE_WARM)
+	return;
+
+    RecountMiss(td, intel_hit, hammerblade_hit);
+    if (slot != MEMOP_PROFILE::NO_SLOT)
+	ProfileMemop(slot, miss_addr, intel_hit, hammerblade_hit);
+    if (!sweep_configs.empty())
+	SweepMemop(td, read_addr, read_size, write_addr, write_size);
+    if (td->trace)
+	TraceMemop(td, read_addr, read_size, write_addr, write_size);
+}
+
+/* ===================================================================== */
+
+typedef VOID (*INSERT_CALL)(INS ins, IPOINT ipoint, AFUNPTR funptr, ...);
+
+/*
+ * Memops that skip the inline filter still have to skip fast forward
+ * windows: with -sample_period their call becomes the Then of an
+ * IfSimulating check. Returns how to insert that call.
+ */
+static INSERT_CALL InsertIfSimulating(INS ins, bool filtered)
+{
+    if (filtered || !sampling)
+	return INS_InsertPredicatedCall;
+
+    INS_InsertIfPredicatedCall(
+	ins, IPOINT_BEFORE, (AFUNPTR) IfSimulating,
+	IARG_FAST_ANALYSIS_CALL,
+	IARG_REG_VALUE, thread_data_reg,
+	IARG_END);
+    return INS_InsertThenPredicatedCall;
+}
+
+/*
+ * Profiled memops skip the inline filter so that their hits are counted
+ * too; they still update last_line for the memops that use it. With
+ * -trace_out no memop uses the filter.
+ */
+static VOID InstrumentMemoryBbl(INS ins)
+{
+    bool is_memory_read, is_memory_write;
+
+    is_memory_read  = INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins);
+    is_memory_write = INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins);
+
+    const UINT32 slot = ProfileSlot(ins, is_memory_read, is_memory_write);
+    const bool filtered = slot == MEMOP_PROFILE::NO_SLOT && !tracing;
+    const INSERT_CALL insert_call = InsertIfSimulating(ins, filtered);
+
+    if (is_memory_read && is_memory_write) {
+	insert_call(
+	    ins, IPOINT_BEFORE, (AFUNPTR) LoadStoreInstructionBbl,
+	    IARG_FAST_ANALYSIS_CALL,
+	    IARG_REG_VALUE, thread_data_reg,
+	    IARG_UINT32, slot,
+	    IARG_MEMORYREAD_EA,
+	    IARG_MEMORYREAD_SIZE,
+	    IARG_MEMORYWRITE_EA,
+	    IARG_MEMORYWRITE_SIZE,
+	    IARG_END);
+    } else if (is_memory_read) {
+	if (filtered) {
+	    INS_InsertIfPredicatedCall(
+		ins, IPOINT_BEFORE, (AFUNPTR) IfNotLastLine,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_MEMORYREAD_EA,
+		IARG_MEMORYREAD_SIZE,
+		IARG_END);
+	    INS_InsertThenPredicatedCall(
+		ins, IPOINT_BEFORE, (AFUNPTR) LoadInstructionBbl,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_UINT32, slot,
+		IARG_MEMORYREAD_EA,
+		IARG_MEMORYREAD_SIZE,
+		IARG_END);
+	} else {
+	    insert_call(
+		ins, IPOINT_BEFORE, (AFUNPTR) LoadInstructionBbl,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_UINT32, slot,
+		IARG_MEMORYREAD_EA,
+		IARG_MEMORYREAD_SIZE,
+		IARG_END);
+	}
+    } else if (is_memory_write) {
+	if (filtered) {
+	    INS_InsertIfPredicatedCall(
+		ins, IPOINT_BEFORE, (AFUNPTR) IfNotLastLine,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_MEMORYWRITE_EA,
+		IARG_MEMORYWRITE_SIZE,
+		IARG_END);
+	    INS_InsertThenPredicatedCall(
+		ins, IPOINT_BEFORE, (AFUNPTR) StoreInstructionBbl,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_UINT32, slot,
+		IARG_MEMORYWRITE_EA,
+		IARG_MEMORYWRITE_SIZE,
+		IARG_END);
+	} else {
+	    insert_call(
+		ins, IPOINT_BEFORE, (AFUNPTR) StoreInstructionBbl,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_UINT32, slot,
+		IARG_MEMORYWRITE_EA,
+		IARG_MEMORYWRITE_SIZE,
+		IARG_END);
+	}
+    }
+}
+
+/*
+ * Buffered fast path: like IfNotLastLine, but also advances last_line since
+ * the line is resident as soon as the record reaches the simulation thread.
+ */
+static
+ADDRINT PIN_FAST_ANALYSIS_CALL IfNewLine(THREAD_DATA *td, ADDRINT addr, UINT32 size)
+{
+    const ADDRINT end_line = (addr + size - 1) >> last_line_shift;
+    const ADDRINT new_line = ((addr >> last_line_shift) ^ td->last_line) | (end_line ^ td->last_line);
+
+    td->last_line = end_line;
+    return new_line;
+}
+
+static
+VOID PIN_FAST_ANALYSIS_CALL SetLastLine(THREAD_DATA *td, ADDRINT addr, UINT32 size)
+{
+    td->last_line = (addr + size - 1) >> last_line_shift;
+}
+
+static VOID InstrumentMemoryBuffered(INS ins)
+{
+    bool is_memory_read, is_memory_write;
+
+    is_memory_read  = INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins);
+    is_memory_write = INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins);
+
+    const UINT32 slot = ProfileSlot(ins, is_memory_read, is_memory_write);
+    const bool filtered = slot == MEMOP_PROFILE::NO_SLOT;
+
+    if (is_memory_read && is_memory_write) {
+	INS_InsertPredicatedCall(
+	    ins, IPOINT_BEFORE, (AFUNPTR) SetLastLine,
+	    IARG_FAST_ANALYSIS_CALL,
+	    IARG_REG_VALUE, thread_data_reg,
+	    IARG_MEMORYWRITE_EA,
+	    IARG_MEMORYWRITE_SIZE,
+	    IARG_END);
+	INS_InsertFillBufferPredicated(
+	    ins, IPOINT_BEFORE, memref_buffer,
+	    IARG_MEMORYREAD_EA, offsetof(MEMREF, addr),
+	    IARG_MEMORYREAD_SIZE, offsetof(MEMREF, size),
+	    IARG_UINT32, MEMREF_LOAD, offsetof(MEMREF, type),
+	    IARG_UINT32, slot, offsetof(MEMREF, slot),
+	    IARG_END);
+	INS_InsertFillBufferPredicated(
+	    ins, IPOINT_BEFORE, memref_buffer,
+	    IARG_MEMORYWRITE_EA, offsetof(MEMREF, addr),
+	    IARG_MEMORYWRITE_SIZE, offsetof(MEMREF, size),
+	    IARG_UINT32, MEMREF_STORE_OF_LOAD, offsetof(MEMREF, type),
+	    IARG_UINT32, slot, offsetof(MEMREF, slot),
+	    IARG_END);
+    } else if (is_memory_read) {
+	if (filtered) {
+	    INS_InsertIfPredicatedCall(
+		ins, IPOINT_BEFORE, (AFUNPTR) IfNewLine,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_MEMORYREAD_EA,
+		IARG_MEMORYREAD_SIZE,
+		IARG_END);
+	    INS_InsertFillBufferThen(
+		ins, IPOINT_BEFORE, memref_buffer,
+		IARG_MEMORYREAD_EA, offsetof(MEMREF, addr),
+		IARG_MEMORYREAD_SIZE, offsetof(MEMREF, size),
+		IARG_UINT32, MEMREF_LOAD, offsetof(MEMREF, type),
+		IARG_UINT32, slot, offsetof(MEMREF, slot),
+		IARG_END);
+	} else {
+	    INS_InsertPredicatedCall(
+		ins, IPOINT_BEFORE, (AFUNPTR) SetLastLine,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_MEMORYREAD_EA,
+		IARG_MEMORYREAD_SIZE,
+		IARG_END);
+	    INS_InsertFillBufferPredicated(
+		ins, IPOINT_BEFORE, memref_buffer,
+		IARG_MEMORYREAD_EA, offsetof(MEMREF, addr),
+		IARG_MEMORYREAD_SIZE, offsetof(MEMREF, size),
+		IARG_UINT32, MEMREF_LOAD, offsetof(MEMREF, type),
+		IARG_UINT32, slot, offsetof(MEMREF, slot),
+		IARG_END);
+	}
+    } else if (is_memory_write) {
+	if (filtered) {
+	    INS_InsertIfPredicatedCall(
+		ins, IPOINT_BEFORE, (AFUNPTR) IfNewLine,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_MEMORYWRITE_EA,
+		IARG_MEMORYWRITE_SIZE,
+		IARG_END);
+	    INS_InsertFillBufferThen(
+		ins, IPOINT_BEFORE, memref_buffer,
+		IARG_MEMORYWRITE_EA, offsetof(MEMREF, addr),
+		IARG_MEMORYWRITE_SIZE, offsetof(MEMREF, size),
+		IARG_UINT32, MEMREF_STORE, offsetof(MEMREF, type),
+		IARG_UINT32, slot, offsetof(MEMREF, slot),
+		IARG_END);
+	} else {
+	    INS_InsertPredicatedCall(
+		ins, IPOINT_BEFORE, (AFUNPTR) SetLastLine,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_MEMORYWRITE_EA,
+		IARG_MEMORYWRITE_SIZE,
+		IARG_END);
+	    INS_InsertFillBufferPredicated(
+		ins, IPOINT_BEFORE, memref_buffer,
+		IARG_MEMORYWRITE_EA, offsetof(MEMREF, addr),
+		IARG_MEMORYWRITE_SIZE, offsetof(MEMREF, size),
+		IARG_UINT32, MEMREF_STORE, offsetof(MEMREF, type),
+		IARG_UINT32, slot, offsetof(MEMREF, slot),
+		IARG_END);
+	}
+    }
+}
+
+static VOID InstrumentBbl(BBL bbl)
+{
+    UINT32 num_ins = 0;
+
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+	// predicated instructions only count when they execute
+	if (INS_IsPredicated(ins)) {
+	    INS_InsertPredicatedCall(
+		ins, IPOINT_BEFORE, (AFUNPTR) CountPredicated,
+		IARG_FAST_ANALYSIS_CALL,
+		IARG_REG_VALUE, thread_data_reg,
+		IARG_END);
+	} else {
+	    num_ins++;
+	}
+	if (KnobBuffer.Value())
+	    InstrumentMemoryBuffered(ins);
+	else
+	    InstrumentMemoryBbl(ins);
+    }
+
+    BBL_InsertCall(
+	bbl, IPOINT_BEFORE, (AFUNPTR) CountBbl,
+	IARG_FAST_ANALYSIS_CALL,
+	IARG_REG_VALUE, thread_data_reg,
+	IARG_UINT32, num_ins,
+	IARG_END);
+
+    if (sampling) {
+	BBL_InsertIfCall(
+	    bbl, IPOINT_BEFORE, (AFUNPTR) IfPhaseOver,
+	    IARG_FAST_ANALYSIS_CALL,
+	    IARG_REG_VALUE, thread_data_reg,
+	    IARG_END);
+	BBL_InsertThenCall(
+	    bbl, IPOINT_BEFORE, (AFUNPTR) NextPhase,
+	    IARG_FAST_ANALYSIS_CALL,
+	    IARG_REG_VALUE, thread_data_reg,
+	    IARG_END);
+    }
+}
+
+static VOID InstrumentInstruction(INS ins);
+
+/*
+ * The routine filter is checked once per trace, and outside the region
+ * of interest nothing but the markers is instrumented.
+ */
+VOID Trace(TRACE trace, void * v)
+{
+    if (roi_markers)
+	InstrumentRoiMarkers(trace);
+    if (!roi_active)
+	return;
+
+    RTN rtn = TRACE_Rtn(trace);
+    if (!RTN_Valid(rtn))
+	return;
+
+    if (!filter.SelectRtn(rtn))
+	return;
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+	if (KnobBblCount.Value()) {
+	    InstrumentBbl(bbl);
+	    continue;
+	}
+
+	for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+	    InstrumentInstruction(ins);
+    }
+}
+
+/* ===================================================================== */
+
+static VOID InstrumentInstruction(INS ins)
+{
+    bool is_memory_read, is_memory_write;
+
+    is_memory_read  = INS_IsMemoryRead(ins) && INS_IsStandardMemop(ins);
+    is_memory_write = INS_IsMemoryWrite(ins) && INS_IsStandardMemop(ins);
+
+    const UINT32 slot = ProfileSlot(ins, is_memory_read, is_memory_write);
+
+    if (is_memory_read && is_memory_write) {
+	INS_InsertPredicatedCall(
+	    ins, IPOINT_BEFORE, (AFUNPTR) LoadStoreInstruction,
+	    IARG_REG_VALUE, thread_data_reg,
+	    IARG_UINT32, slot,
+	    IARG_MEMORYREAD_EA,
+	    IARG_MEMORYREAD_SIZE,
+	    IARG_MEMORYWRITE_EA,
+	    IARG_MEMORYWRITE_SIZE,
+	    IARG_END);	
+    } else if (is_memory_read) {
+	// for instructions that read
+	INS_InsertPredicatedCall(
+	    ins, IPOINT_BEFORE, (AFUNPTR) LoadInstruction,
+	    IARG_REG_VALUE, thread_data_reg,
+	    IARG_UINT32, slot,
+	    IARG_MEMORYREAD_EA,
+	    IARG_MEMORYREAD_SIZE,
+	    IARG_END);	
+    } else if (is_memory_write) {
+	// for instructions that write
+	INS_InsertPredicatedCall(
+	    ins, IPOINT_BEFORE, (AFUNPTR) StoreInstruction,
+	    IARG_REG_VALUE, thread_data_reg,
+	    IARG_UINT32, slot,
+	    IARG_MEMORYWRITE_EA,
+	    IARG_MEMORYWRITE_SIZE,
+	    IARG_END);
+    } else {
+	// for non memory instructions
+	INS_InsertPredicatedCall(
+	    ins, IPOINT_BEFORE, (AFUNPTR) NonMemoryInstruction,
+	    IARG_REG_VALUE, thread_data_reg,
+	    IARG_END);
+    }        
+}
+
+/*
+ * DRAM energy of every line a prefetcher's cache moved: its demand
+ * misses by class and all the lines it prefetched, used or not. scale
+ * extrapolates sampled counts.
+ */
+static double PatternJoules(const PREFETCHER &prefetcher, double jpbit, UINT32 line_size, double scale)
+{
+    const UINT64 irregular = prefetcher.misses[PREFETCH::MISS_IRREGULAR] * scale;
+    const UINT64 streamed = (prefetcher.misses[PREFETCH::MISS_SEQUENTIAL]
+			     + prefetcher.misses[PREFETCH::MISS_STRIDED]
+			     + prefetcher.filled) * scale;
+
+    return DramJoules(jpbit, irregular, streamed, line_size);
+}
+
+/*
+ * Every energy figure of the reports comes from these two. Without a
+ * prefetcher every missed instruction costs one line. With one, a
+ * prefetched line that is used is a hit, so the DRAM energy is charged
+ * per class instead, prefetches included, and misses is not used.
+ */
+static double HammerBladeJoules(UINT64 instructions, UINT64 misses,
+				const PREFETCHER *prefetch = NULL, double scale = 1)
+{
+    if (prefetch)
+	return ENERGY::HammerBlade_JPInstruction * instructions
+	    + PatternJoules(*prefetch, ENERGY::HBM2_JPBit, KnobLineSize.Value(), scale);
+    return HammerBladeJoules(instructions, misses, KnobLineSize.Value());
+}
+
+static double XeonJoules(UINT64 instructions, UINT64 misses,
+			 const PREFETCHER *prefetch = NULL, double scale = 1)
+{
+    if (prefetch)
+	return ENERGY::Xeon_JPInstruction * instructions
+	    + PatternJoules(*prefetch, ENERGY::DDR4_JPBit, INTEL_CACHELINE_SIZE, scale);
+    return XeonJoules(instructions, misses, INTEL_CACHELINE_SIZE);
+}
+
+static void ReportGopsPerWatt(const std::string &suffix,
+			      const UINT64 *hammerblade_icount, const UINT64 *intel_icount,
+			      const PREFETCHER *hb_prefetch = NULL, const PREFETCHER *xeon_prefetch = NULL,
+			      double scale = 1)
+{
+    const int prefix_width = 16;
+    std::string hammerblade_prefix = "HammerBlade";
+    std::string xeon_prefix        = "Xeon E7-8894 v4";
+
+    const UINT64 hammerblade_instructions = hammerblade_icount[COUNTER_HIT] + hammerblade_icount[COUNTER_MISS];
+    const UINT64 intel_instructions = intel_icount[COUNTER_HIT] + intel_icount[COUNTER_MISS];
+
+    double Joules_hammerblade = HammerBladeJoules(hammerblade_instructions, hammerblade_icount[COUNTER_MISS],
+						  hb_prefetch, scale);
+    double Joules_xeon = XeonJoules(intel_instructions, intel_icount[COUNTER_MISS], xeon_prefetch, scale);
+
+    // // performance
+    // double Time_DRAM_Xeon = 60e-9; // 60ns
+    // double Time_DRAM_Hammerblade = (0.116e-9)*16; // 0.116ns
+    
+    // outFile << std::setw(prefix_width) << hammerblade_prefix << " Estimated Performance: " << std::scientific << Time_DRAM_Hammerblade * hammerblade_icount[COUNTER_MISS] << "\n";
+    // outFile << std::setw(prefix_width) << xeon_prefix        << " Estimated Performance: " << std::scientific << Time_DRAM_Xeon * intel_icount[COUNTER_MISS]              << "\n";
+    // // IPC, HZ => Instructions / (IPC * HZ) = Seconds
+    // // Take Joules/Seconds
+    
+    // // outFile << std::setw(prefix_width) << hammerblade_prefix << ": "
+    // //         << "Instructions: " << std::scientific << (double) (hammerblade_icount[COUNTER_HIT]+hammerblade_icount[COUNTER_MISS]) << ", "
+    // //         << "DRAM Bits: "   << std::scientific << (double) (hammerblade_icount[COUNTER_MISS] * dl1->LineSize() * 8) << ", "
+    // //         << "Misses: "      << std::scientific << (double) (hammerblade_icount[COUNTER_MISS])
+    // //         << "\n";
+
+    // // outFile << std::setw(prefix_width) << xeon_prefix << ": "
+    // //         << "Instructions: " << std::scientific << (double) (intel_icount[COUNTER_HIT]+intel_icount[COUNTER_MISS]) << ", "
+    // //         << "DRAM Bits: "   << std::scientific << (double) (intel_icount[COUNTER_MISS] * INTEL_CACHELINE_SIZE * 8) << ", "
+    // //         << "Misses: "      << std::scientific << (double) (intel_icount[COUNTER_MISS])
+    // //         << "\n";
+    
+    // outFile << std::setw(prefix_width) << hammerblade_prefix << " Energy Cost: " << std::scientific << Joules_hammerblade << " J\n";
+    // // outFile << std::setw(prefix_width) << hammerblade_prefix << ": "
+    // //         << "Ins Energy Cost (%): "  << std::fixed << (Joules_hammerblade_insts/Joules_hammerblade)*100 << ", "
+    // //         << "Mem Energy Cost (%): "  << std::fixed << (Joules_hammerblade_membits/Joules_hammerblade)*100
+    // //         << "\n";
+    
+    
+    // outFile << std::setw(prefix_width) << xeon_prefix << " Energy Cost: " << std::scientific << Joules_xeon << " J\n";
+    // // outFile << std::setw(prefix_width) << xeon_prefix << ": "
+    // //         << "Ins Energy Cost (%): " << std::fixed << ((double)Joules_xeon_insts/Joules_xeon)*100 << ", "
+    // //         << "Mem Energy Cost (%): " << std::fixed << ((double)Joules_xeon_membits/Joules_xeon)*100
+    // //         << "\n";
+
+    double hammerblade_gop = hammerblade_instructions/1e9;
+    double intel_gop       = intel_instructions/1e9;
+    
+    outFile << std::setw(prefix_width) << hammerblade_prefix + suffix << ": "
+            << std::scientific << hammerblade_gop / Joules_hammerblade << " GOPS/Watt\n";
+
+    outFile << std::setw(prefix_width) << xeon_prefix + suffix << ": "
+            << std::scientific <<  intel_gop / Joules_xeon << " GOPS/Watt\n";
+    
+    // outFile << "Energy Cost Ratio (" << xeon_prefix << "/" << hammerblade_prefix << "): " << std::fixed << Joules_xeon/Joules_hammerblade << "\n";
+}
+
+/*
+ * One row per call of the epoch marker; epoch 0 is whatever ran before
+ * the first call. The prefetchers are not counted per epoch, so the
+ * energy leaves their traffic out.
+ */
+static void ReportEpochs()
+{
+    EPOCH_STATS end = {
+	hammerblade_icount[COUNTER_HIT] + hammerblade_icount[COUNTER_MISS],
+	hammerblade_icount[COUNTER_MISS],
+	intel_icount[COUNTER_MISS]
+    };
+    epoch_starts.push_back(end);
+
+    std::string markers;
+    for (std::set<std::string>::const_iterator it = epoch_markers.begin(); it != epoch_markers.end(); ++it)
+	markers += (markers.empty() ? "" : ", ") + *it;
+
+    outFile << "\nEpochs (" << markers
+	    << (sampling ? ", misses of the detailed windows only" : "")
+	    << (hb_prefetching || xeon_prefetching ? ", energy without prefetch traffic" : "") << "):\n"
+	    << std::setw(8)  << "epoch"
+	    << std::setw(16) << "instructions"
+	    << std::setw(14) << "hb-misses"
+	    << std::setw(14) << "xeon-misses"
+	    << std::setw(14) << "hb-J"
+	    << std::setw(14) << "xeon-J" << "\n";
+
+    EPOCH_STATS start = { 0, 0, 0 };
+    for (UINT32 epoch = 0; epoch < epoch_starts.size(); epoch++) {
+	const EPOCH_STATS &next = epoch_starts[epoch];
+	UINT64 instructions = next.instructions - start.instructions;
+	UINT64 hammerblade_misses = next.hammerblade_misses - start.hammerblade_misses;
+	UINT64 intel_misses = next.intel_misses - start.intel_misses;
+
+	outFile << std::setw(8)  << epoch
+		<< std::setw(16) << instructions
+		<< std::setw(14) << hammerblade_misses
+		<< std::setw(14) << intel_misses
+		<< std::setw(14) << std::setprecision(3) << std::scientific
+		<< HammerBladeJoules(instructions, hammerblade_misses)
+		<< std::setw(14) << XeonJoules(instructions, intel_misses) << "\n";
+
+	start = next;
+    }
+    outFile << std::setprecision(6);
+}
+
+/*
+ * One row per -kernel routine over all threads; a kernel's instructions
+ * are those of the filtered routines it ran, itself included. As for
+ * epochs, the energy leaves prefetch traffic out.
+ */
+static void ReportKernels(const std::vector<KERNEL_STATS> &stats)
+{
+    std::string notes = sampling ? "misses of the detailed windows only" : "";
+    if (hb_prefetching || xeon_prefetching)
+	notes += (notes.empty() ? "" : ", ") + std::string("energy without prefetch traffic");
+
+    outFile << "\nKernels" << (notes.empty() ? "" : " (" + notes + ")") << ":\n"
+	    << std::setw(10) << "calls"
+	    << std::setw(16) << "instructions"
+	    << std::setw(14) << "hb-misses"
+	    << std::setw(14) << "xeon-misses"
+	    << std::setw(14) << "hb-J"
+	    << std::setw(14) << "xeon-J"
+	    << "  kernel\n";
+
+    for (UINT32 k = 0; k < kernels.size(); k++) {
+	outFile << std::setw(10) << stats[k].calls
+		<< std::setw(16) << stats[k].instructions
+		<< std::setw(14) << stats[k].hammerblade_misses
+		<< std::setw(14) << stats[k].intel_misses
+		<< std::setw(14) << std::setprecision(3) << std::scientific
+		<< HammerBladeJoules(stats[k].instructions, stats[k].hammerblade_misses)
+		<< std::setw(14) << XeonJoules(stats[k].instructions, stats[k].intel_misses)
+		<< "  " << kernels[k] << "\n";
+    }
+    outFile << std::setprecision(6);
+}
+
+/*
+ * How the bursts spread over the channels and banks: totals per channel,
+ * then per window of bursts the number of channels used and how much
+ * busier the busiest channel was than the mean. Occupancy is the time a
+ * channel needs for its bytes at its share of the peak bandwidth, over
+ * the estimated runtime.
+ */
+static void ReportHbmChannels(const HBM_CHANNELS &channels, double runtime)
+{
+    const double channel_bandwidth = KnobHbmGBps.Value() * 1e9 / channels.NumChannels();
+    UINT64 total_bytes = 0, windows = 0;
+
+    for (UINT32 c = 0; c < channels.NumChannels(); c++)
+	total_bytes += channels.bytes[c];
+    for (UINT32 i = 0; i < channels.parallelism.size(); i++)
+	windows += channels.parallelism[i];
+
+    outFile << "\nHBM channels (" << channels.NumChannels() << " channels x "
+	    << channels.NumBanks() << " banks, " << channels.Interleave() << " byte interleave"
+	    << (sampling ? ", detailed windows only" : "") << "):\n"
+	    << std::setw(8)  << "channel"
+	    << std::setw(14) << "requests"
+	    << std::setw(16) << "bytes"
+	    << std::setw(10) << "share"
+	    << std::setw(12) << "hot-bank"
+	    << std::setw(12) << "occupancy" << "\n";
+
+    outFile << std::fixed << std::setprecision(1);
+    for (UINT32 c = 0; c < channels.NumChannels(); c++) {
+	const UINT64 *banks = &channels.bankBytes[c * channels.NumBanks()];
+	const UINT64 hot_bank = *std::max_element(banks, banks + channels.NumBanks());
+	const double busy = channels.bytes[c] * sample_scale / channel_bandwidth;
+
+	outFile << std::setw(8)  << c
+		<< std::setw(14) << channels.requests[c]
+		<< std::setw(16) << channels.bytes[c]
+		<< std::setw(9)  << (total_bytes ? 100.0 * channels.bytes[c] / total_bytes : 0) << "%"
+		<< std::setw(11) << (channels.bytes[c] ? 100.0 * hot_bank / channels.bytes[c] : 0) << "%"
+		<< std::setw(11) << (runtime > 0 ? 100.0 * busy / runtime : 0) << "%\n";
+    }
+
+    outFile << "\nHBM channels used per window of " << channels.Window() << " bursts:\n";
+    for (UINT32 n = 1; n < channels.parallelism.size(); n++) {
+	outFile << std::setw(8) << n
+		<< std::setw(14) << channels.parallelism[n]
+		<< std::setw(9) << (windows ? 100.0 * channels.parallelism[n] / windows : 0) << "%\n";
+    }
+
+    outFile << "\nHBM busiest channel / mean channel per window:\n";
+    for (UINT32 b = 0; b < channels.imbalance.size(); b++) {
+	const double low = 1.0 + (double) b / HBM_CHANNELS::IMBALANCE_STEPS;
+	std::string range = b + 1 < channels.imbalance.size()
+	    ? fltstr(low, 1) + "-" + fltstr(low + 1.0 / HBM_CHANNELS::IMBALANCE_STEPS, 1)
+	    : fltstr(low, 1) + "+";
+
+	outFile << std::setw(8) << range
+		<< std::setw(14) << channels.imbalance[b]
+		<< std::setw(9) << (windows ? 100.0 * channels.imbalance[b] / windows : 0) << "%\n";
+    }
+    outFile << std::scientific << std::setprecision(6);
+}
+
+/*
+ * Every core keeps one HBM burst in flight, so the memory time is the
+ * summed burst latency spread over the cores, but never less than what
+ * the peak bandwidth allows, nor than what the busiest channel's share
+ * of it allows.
+ */
+static void ReportHbm(UINT64 bursts, UINT64 bytes, double nanoseconds, double joules,
+		      const HBM_CHANNELS &channels)
+{
+    const int prefix_width = 16;
+    std::string hammerblade_prefix = "HammerBlade";
+
+    UINT64 busiest_bytes = *std::max_element(channels.bytes.begin(), channels.bytes.end());
+    double channel_bandwidth = KnobHbmGBps.Value() * 1e9 / channels.NumChannels();
+
+    double instructions = hammerblade_icount[COUNTER_HIT] + hammerblade_icount[COUNTER_MISS];
+    double Time_compute = instructions / (KnobHbCores.Value() * KnobHbMHz.Value() * 1e6);
+    double Time_channel = busiest_bytes * sample_scale / channel_bandwidth;
+    double Time_hbm = std::max(std::max(nanoseconds * 1e-9 / KnobHbCores.Value(),
+					bytes / (KnobHbmGBps.Value() * 1e9)),
+			       Time_channel);
+    double Time = std::max(Time_compute, Time_hbm);
+
+    outFile << std::setw(prefix_width) << hammerblade_prefix << ": "
+	    << std::scientific << Time << " s estimated runtime"
+	    << " (compute " << Time_compute << " s, HBM " << Time_hbm << " s"
+	    << ", busiest channel " << Time_channel << " s)\n";
+
+    outFile << std::setw(prefix_width) << hammerblade_prefix << ": "
+	    << std::scientific << (Time > 0 ? bytes / Time / 1e9 : 0) << " GB/s achieved HBM bandwidth\n";
+
+    outFile << std::setw(prefix_width) << hammerblade_prefix << ": "
+	    << std::scientific << joules << " J HBM energy"
+	    << " (" << bursts << " bursts, " << bytes << " bytes, "
+	    << std::fixed << std::setprecision(2) << (bytes ? joules / (bytes * 8) * 1e12 : 0)
+	    << " pJ/bit)\n" << std::scientific << std::setprecision(6);
+
+    ReportHbmChannels(channels, Time);
+}
+
+static std::string LocationString(const SOURCE_LOCATION &location)
+{
+    std::string where = *location.rtn;
+
+    if (!location.file->empty())
+	where += " " + *location.file + ":" + decstr(location.line);
+
+    return where;
+}
+
+static bool MoreMemopMisses(UINT32 a, UINT32 b)
+{
+    const MEMOP_ENTRY &x = profile[a], &y = profile[b];
+
+    if (x.hammerblade[COUNTER_MISS] != y.hammerblade[COUNTER_MISS])
+	return x.hammerblade[COUNTER_MISS] > y.hammerblade[COUNTER_MISS];
+    return x.intel[COUNTER_MISS] > y.intel[COUNTER_MISS];
+}
+
+static bool MoreAllocationMisses(const ALLOCATION *a, const ALLOCATION *b)
+{
+    if (a->hammerblade_misses != b->hammerblade_misses)
+	return a->hammerblade_misses > b->hammerblade_misses;
+    return a->intel_misses > b->intel_misses;
+}
+
+/*
+ * Memops that reached either threshold in either model, most HammerBlade
+ * misses first.
+ */
+static void ReportMemops()
+{
+    std::vector<UINT32> slots;
+
+    for (UINT32 slot = 1; slot < profile.NumSlots(); slot++) {
+	const MEMOP_ENTRY &entry = profile[slot];
+
+	if (entry.hammerblade[COUNTER_MISS] >= threshold[COUNTER_MISS]
+	    || entry.intel[COUNTER_MISS] >= threshold[COUNTER_MISS]
+	    || entry.hammerblade[COUNTER_HIT] >= threshold[COUNTER_HIT]
+	    || entry.intel[COUNTER_HIT] >= threshold[COUNTER_HIT])
+	    slots.push_back(slot);
+    }
+    std::sort(slots.begin(), slots.end(), MoreMemopMisses);
+
+    outFile << "\nMemory instructions (" << threshold[COUNTER_MISS] << " misses or "
+	    << threshold[COUNTER_HIT] << " hits"
+	    << (sampling ? ", detailed windows only" : "") << "):\n"
+	    << std::setw(20) << "iaddr"
+	    << std::setw(14) << "hb-misses"
+	    << std::setw(14) << "hb-hits"
+	    << std::setw(14) << "xeon-misses"
+	    << std::setw(14) << "xeon-hits"
+	    << "  location\n";
+
+    for (UINT32 i = 0; i < slots.size(); i++) {
+	const MEMOP_ENTRY &entry = profile[slots[i]];
+
+	outFile << std::setw(20) << StringFromAddrint(entry.iaddr)
+		<< std::setw(14) << entry.hammerblade[COUNTER_MISS]
+		<< std::setw(14) << entry.hammerblade[COUNTER_HIT]
+		<< std::setw(14) << entry.intel[COUNTER_MISS]
+		<< std::setw(14) << entry.intel[COUNTER_HIT]
+		<< "  " << LocationString(memop_sources[slots[i]]) << "\n";
+    }
+}
+
+/*
+ * Misses of the tracked memops by the allocation they fell in, freed
+ * allocations included.
+ */
+static void ReportAllocations()
+{
+    std::vector<ALLOCATION*> missed;
+
+    for (UINT32 i = 0; i < allocations.size(); i++) {
+	if (allocations[i]->hammerblade_misses || allocations[i]->intel_misses)
+	    missed.push_back(allocations[i]);
+    }
+    std::sort(missed.begin(), missed.end(), MoreAllocationMisses);
+
+    outFile << "\nAllocations of at least " << KnobAllocationMin.Value() << " bytes:\n"
+	    << std::setw(20) << "start"
+	    << std::setw(14) << "bytes"
+	    << std::setw(14) << "hb-misses"
+	    << std::setw(14) << "xeon-misses"
+	    << "  allocated at\n";
+
+    for (UINT32 i = 0; i < missed.size(); i++) {
+	outFile << std::setw(20) << StringFromAddrint(missed[i]->start)
+		<< std::setw(14) << missed[i]->size
+		<< std::setw(14) << missed[i]->hammerblade_misses
+		<< std::setw(14) << missed[i]->intel_misses
+		<< "  " << LocationString(missed[i]->site) << "\n";
+    }
+
+    outFile << std::setw(20) << "other"
+	    << std::setw(14) << ""
+	    << std::setw(14) << unattributed.hammerblade_misses
+	    << std::setw(14) << unattributed.intel_misses << "\n";
+}
+
+static std::string SizeString(UINT64 bytes)
+{
+    if (bytes >= MEGA && bytes % MEGA == 0)
+	return decstr(bytes / MEGA) + "MB";
+    if (bytes >= KILO && bytes % KILO == 0)
+	return decstr(bytes / KILO) + "KB";
+    return decstr(bytes) + "B";
+}
+
+/* Misses of one grid point of sweep_configs[config], summed over the threads */
+static UINT64 SweepMisses(UINT32 config, bool full, UINT64 lines, UINT32 sets, UINT32 ways)
+{
+    UINT64 misses = 0;
+
+    for (UINT32 tid = 0; tid < num_threads; tid++) {
+	const THREAD_DATA *td = thread_data[tid];
+	if (!td)
+	    continue;
+
+	const CACHE_SWEEP &sweep = *td->sweeps[config];
+	misses += full ? sweep.FullMisses(lines) : sweep.Misses(sets, ways);
+    }
+    return misses;
+}
+
+/*
+ * Two tables per line size, rows by cache size and columns by
+ * associativity: the instructions that missed, then the GOPS/Watt the
+ * HammerBlade energy model gives for them. "-" marks a grid point with
+ * fewer lines than ways. Every thread has its own caches, as in the main
+ * models.
+ */
+static void ReportSweep()
+{
+    const UINT64 instructions = hammerblade_icount[COUNTER_HIT] + hammerblade_icount[COUNTER_MISS];
+    const UINT64 min_bytes = (UINT64)sweep_min_kb * KILO;
+    const UINT64 max_bytes = (UINT64)sweep_max_kb * KILO;
+
+    if (sweep_lowered)
+	outFile << "\nLRU sweep only up to " << SizeString(max_bytes) << " to fit -sweep_mb "
+		<< KnobSweepMB.Value() << " with " << sweep_threads << " threads\n";
+
+    for (UINT32 i = 0; i < sweep_configs.size(); i++) {
+	const SWEEP_CONFIG &config = sweep_configs[i];
+
+	for (UINT32 table = 0; table < 2; table++) {
+	    outFile << "\nLRU sweep, " << config.line_size << " byte lines ("
+		    << (table == 0 ? "instructions that missed" : "HammerBlade GOPS/Watt, no prefetcher") << "):\n"
+		    << std::setw(8) << "size";
+	    for (UINT32 ways = 1; ways <= CACHE_SWEEP::MAX_WAYS; ways *= 2)
+		outFile << std::setw(12) << decstr(ways) + "-way";
+	    outFile << std::setw(12) << "full" << "\n";
+
+	    for (UINT64 bytes = min_bytes; bytes <= max_bytes; bytes *= 2) {
+		const UINT64 lines = bytes / config.line_size;
+
+		outFile << std::setw(8) << SizeString(bytes);
+		for (UINT32 ways = 1; ways <= CACHE_SWEEP::MAX_WAYS * 2; ways *= 2) {
+		    bool full = ways > CACHE_SWEEP::MAX_WAYS;
+		    UINT32 sets = full ? 1 : lines / ways;
+
+		    if (lines == 0 || (!full && (sets < config.min_sets || sets > config.max_sets))) {
+			outFile << std::setw(12) << "-";
+			continue;
+		    }
+
+		    UINT64 misses = SweepMisses(i, full, lines, sets, ways) * sample_scale;
+		    if (table == 0)
+			outFile << std::setw(12) << misses;
+		    else
+			outFile << std::setw(12) << std::setprecision(3) << std::scientific
+				<< instructions / 1e9 / HammerBladeJoules(instructions, misses, config.line_size);
+		}
+		outFile << "\n";
+	    }
+	    outFile << std::setprecision(6);
+	}
+    }
+}
+
+/*
+ * Extrapolated misses with their 95% confidence intervals, and the
+ * GOPS/Watt range those give. With a prefetcher its lines are scaled by
+ * the same factor as the misses at each end of the interval.
+ */
+static void ReportSampling(const SAMPLE_ESTIMATE &estimate,
+			   const PREFETCHER *hb_prefetch, const PREFETCHER *xeon_prefetch)
+{
+    const int prefix_width = 16;
+    const double gop = estimate.instructions / 1e9;
+
+    outFile << "Sampling: " << estimate.windows << " detailed windows, "
+	    << estimate.detailed << " of " << estimate.instructions << " instructions simulated ("
+	    << std::fixed << std::setprecision(2)
+	    << (estimate.instructions ? 100.0 * estimate.detailed / estimate.instructions : 0)
+	    << "%)\n" << std::scientific << std::setprecision(3);
+
+    for (UINT32 model = 0; model < 2; model++) {
+	const bool hammerblade = model == 0;
+	const double misses = hammerblade ? estimate.hammerblade_misses : estimate.intel_misses;
+	const double error = hammerblade ? estimate.hammerblade_error : estimate.intel_error;
+	const double least = std::max(misses - error, 0.0), most = misses + error;
+	const double least_scale = misses > 0 ? sample_scale * least / misses : sample_scale;
+	const double most_scale = misses > 0 ? sample_scale * most / misses : sample_scale;
+
+	double low, high;
+	if (hammerblade) {
+	    low = gop / HammerBladeJoules(estimate.instructions, most, hb_prefetch, most_scale);
+	    high = gop / HammerBladeJoules(estimate.instructions, least, hb_prefetch, least_scale);
+	} else {
+	    low = gop / XeonJoules(estimate.instructions, most, xeon_prefetch, most_scale);
+	    high = gop / XeonJoules(estimate.instructions, least, xeon_prefetch, least_scale);
+	}
+
+	outFile << std::setw(prefix_width) << (hammerblade ? "HammerBlade" : "Xeon E7-8894 v4") << ": "
+		<< misses << " +- " << error << " misses (95%), "
+		<< low << " to " << high << " GOPS/Watt\n";
+    }
+    outFile << std::setprecision(6);
+}
+
+/*
+ * Line misses of every level of the Xeon hierarchy. The inline last-line
+ * filter only skips L1 hits, so these are exact in every mode.
+ */
+static void ReportXeonLevels(UINT64 l1_misses, UINT64 l2_misses, UINT64 llc_misses)
+{
+    const int prefix_width = 16;
+    std::string xeon_prefix = "Xeon E7-8894 v4";
+
+    outFile << std::setw(prefix_width) << xeon_prefix << ": "
+	    << l1_misses << " L1, " << l2_misses << " L2, "
+	    << llc_misses << " LLC line misses\n";
+}
+
+/*
+ * One machine's line misses by access pattern and its prefetch traffic.
+ * Every line moved from DRAM is charged, streamed lines at
+ * ENERGY::DRAM_Stream_Fraction of the cost of irregular ones; the
+ * GOPS/Watt lines use the same total.
+ */
+static void ReportPrefetch(const std::string &machine, const PREFETCHER &prefetcher, UINT32 line_size,
+			   double jpbit)
+{
+    const int prefix_width = 16;
+    const char *names[] = { "sequential", "strided", "irregular",
+			    "prefetch-useful", "prefetch-late", "prefetch-wasted" };
+    const UINT64 lines[] = { prefetcher.misses[PREFETCH::MISS_SEQUENTIAL],
+			     prefetcher.misses[PREFETCH::MISS_STRIDED],
+			     prefetcher.misses[PREFETCH::MISS_IRREGULAR],
+			     prefetcher.useful, prefetcher.late, prefetcher.wasted };
+    const UINT32 irregular = 2;
+    const UINT32 num_rows = sizeof(lines) / sizeof(lines[0]);
+
+    outFile << "\n" << machine << " line misses by access pattern, prefetcher "
+	    << PREFETCH::kind_names[prefetcher.Kind()];
+    if (prefetcher.Kind() != PREFETCH::KIND_NONE)
+	outFile << " of degree " << prefetcher.Degree();
+    outFile << (sampling ? ", extrapolated" : "") << ":\n"
+	    << std::setw(prefix_width) << "class"
+	    << std::setw(14) << "lines"
+	    << std::setw(16) << "bytes"
+	    << std::setw(14) << "DRAM-J" << "\n";
+
+    double total_joules = 0;
+    UINT64 total_lines = 0;
+
+    for (UINT32 i = 0; i < num_rows; i++) {
+	const UINT64 scaled = lines[i] * sample_scale;
+	const double joules = i == irregular
+	    ? DramJoules(jpbit, scaled, 0, line_size)
+	    : DramJoules(jpbit, 0, scaled, line_size);
+
+	total_lines += scaled;
+	total_joules += joules;
+	outFile << std::setw(prefix_width) << names[i]
+		<< std::setw(14) << scaled
+		<< std::setw(16) << scaled * line_size
+		<< std::setw(14) << std::scientific << joules << "\n";
+    }
+    outFile << std::setw(prefix_width) << "total"
+	    << std::setw(14) << total_lines
+	    << std::setw(16) << total_lines * line_size
+	    << std::setw(14) << total_joules << "\n";
+}
+
+static void HBPintoolFini(int code, void *v)
+{
+    UINT64 hbm_bursts = 0, hbm_bytes = 0;
+    double hbm_nanoseconds = 0, hbm_joules = 0;
+    UINT64 l1_misses = 0, l2_misses = 0, llc_misses = 0;
+    std::vector<SAMPLE_WINDOW> windows;
+    SAMPLE_ESTIMATE estimate;
+    std::vector<KERNEL_STATS> kernel_stats(kernels.size());
+    HBM_CHANNELS hbm_channels(KnobHbmChannels.Value(), KnobHbmBanks.Value(),
+			      KnobHbmInterleave.Value(), hbm_window);
+    PREFETCHER hb_prefetch(hb_prefetch_kind, KnobPrefetchDegree.Value(), KnobPrefetchLate.Value(),
+			   KnobLineSize.Value());
+    PREFETCHER xeon_prefetch(xeon_prefetch_kind, KnobPrefetchDegree.Value(), KnobPrefetchLate.Value(),
+			     INTEL_CACHELINE_SIZE);
+
+    // threads that never reached a detailed window use everyone's
+    for (UINT32 tid = 0; tid < num_threads && sampling; tid++) {
+	THREAD_DATA *td = thread_data[tid];
+	if (!td)
+	    continue;
+
+	if (td->sample_phase == SAMPLE_DETAILED)
+	    CloseWindow(td);
+	windows.insert(windows.end(), td->windows.begin(), td->windows.end());
+    }
+
+    for (UINT32 tid = 0; tid < num_threads; tid++) {
+	THREAD_DATA *td = thread_data[tid];
+	if (!td)
+	    continue;
+
+	FinishTrace(td);
+	if (KnobBuffer.Value())
+	    FoldBufferedMisses(td);
+	td->hbm.Flush();
+	td->hbm_channels.Flush();
+	hbm_channels.Add(td->hbm_channels);
+
+	if (td->hb_prefetcher) {
+	    td->hb_prefetcher->Flush();
+	    hb_prefetch.Add(*td->hb_prefetcher);
+	}
+	if (td->xeon_prefetcher) {
+	    td->xeon_prefetcher->Flush();
+	    xeon_prefetch.Add(*td->xeon_prefetcher);
+	}
+	hbm_bursts += td->hbm.bursts;
+	hbm_bytes += td->hbm.bytes;
+	hbm_nanoseconds += td->hbm.nanoseconds;
+	hbm_joules += td->hbm.joules;
+
+	l1_misses += td->dl1_intel->L1Misses();
+	l2_misses += td->dl1_intel->L2Misses();
+	llc_misses += td->dl1_intel->LlcMisses();
+
+	for (UINT32 i = 0; i < COUNTER_NUM; i++) {
+	    hammerblade_icount[i] += td->hammerblade_icount[i];
+	    intel_icount[i] += td->intel_icount[i];
+	}
+
+	for (UINT32 k = 0; k < kernels.size(); k++) {
+	    kernel_stats[k].calls += td->kernel_stats[k].calls;
+	    kernel_stats[k].instructions += td->kernel_stats[k].instructions;
+	    kernel_stats[k].hammerblade_misses += td->kernel_stats[k].hammerblade_misses;
+	    kernel_stats[k].intel_misses += td->kernel_stats[k].intel_misses;
+	}
+
+	double thread_scale = 1;
+	if (sampling) {
+	    EstimateMisses(td->windows.empty() ? windows : td->windows, td->Instructions(), estimate);
+	    Extrapolate(estimate, td->hammerblade_icount, td->intel_icount);
+	    if (estimate.detailed)
+		thread_scale = (double) estimate.instructions / estimate.detailed;
+	}
+
+	if (KnobPerThread.Value())
+	    ReportGopsPerWatt(" [thread " + decstr(tid) + "]",
+			      td->hammerblade_icount, td->intel_icount,
+			      td->hb_prefetcher, td->xeon_prefetcher, thread_scale);
+    }
+
+    if (sampling) {
+	EstimateMisses(windows, hammerblade_icount[COUNTER_HIT] + hammerblade_icount[COUNTER_MISS], estimate);
+	if (estimate.detailed)
+	    sample_scale = (double) estimate.instructions / estimate.detailed;
+	Extrapolate(estimate, &hammerblade_icount[0], &intel_icount[0]);
+
+	l1_misses *= sample_scale;
+	l2_misses *= sample_scale;
+	llc_misses *= sample_scale;
+	hbm_bursts *= sample_scale;
+	hbm_bytes *= sample_scale;
+	hbm_nanoseconds *= sample_scale;
+	hbm_joules *= sample_scale;
+    }
+
+    ReportGopsPerWatt("", &hammerblade_icount[0], &intel_icount[0],
+		      hb_prefetching ? &hb_prefetch : NULL, xeon_prefetching ? &xeon_prefetch : NULL,
+		      sample_scale);
+    if (sampling)
+	ReportSampling(estimate, hb_prefetching ? &hb_prefetch : NULL,
+		       xeon_prefetching ? &xeon_prefetch : NULL);
+    ReportXeonLevels(l1_misses, l2_misses, llc_misses);
+    if (hb_prefetching)
+	ReportPrefetch("HammerBlade", hb_prefetch, KnobLineSize.Value(), ENERGY::HBM2_JPBit);
+    if (xeon_prefetching)
+	ReportPrefetch("Xeon E7-8894 v4", xeon_prefetch, INTEL_CACHELINE_SIZE, ENERGY::DDR4_JPBit);
+    ReportHbm(hbm_bursts, hbm_bytes, hbm_nanoseconds, hbm_joules, hbm_channels);
+
+    if (roi_markers)
+	outFile << "Region of interest entered " << roi_entries << " times\n";
+
+    if (KnobEpochStats.Value() && !epoch_starts.empty())
+	ReportEpochs();
+
+    if (!kernels.empty())
+	ReportKernels(kernel_stats);
+
+    if (KnobTrackLoads.Value() || KnobTrackStores.Value()) {
+	ReportMemops();
+	ReportAllocations();
+    }
+
+    if (!sweep_configs.empty())
+	ReportSweep();
+}
+
+VOID Fini(int code, VOID * v)
+{
+    // OriginalFini(code, v);
+    HBPintoolFini(code, v);
+    outFile.close();
+    if (tracing)
+	trace_file.close();
+}
+/* ===================================================================== */
+/* Telemetry (-telemetry)                                                */
+/*                                                                       */
+/* An internal thread wakes up every -telemetry_ms, sums the counters of */
+/* all threads and appends one flushed CSV row, so a run that is killed  */
+/* still leaves its history behind. The analysis routines never see it: */
+/* it reads their counters while they run, and a row may be off by the  */
+/* few memops that are in flight. Under -sample_period the misses are    */
+/* extrapolated from the windows closed so far, like at Fini.            */
+/* ===================================================================== */
+
+std::ofstream telemetry_file;
+PIN_THREAD_UID telemetry_thread_uid;
+volatile bool telemetry_exiting = false;
+UINT64 telemetry_next = 0;	// instructions of the next row
+struct timespec telemetry_start;
+
+static double TelemetrySeconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - telemetry_start.tv_sec) + (now.tv_nsec - telemetry_start.tv_nsec) * 1e-9;
+}
+
+static VOID WriteTelemetryRow(bool last)
+{
+    UINT64 threads = 0, instructions = 0, hammerblade_misses = 0, intel_misses = 0;
+    UINT64 hbm_bytes = 0;
+    double hbm_joules = 0;
+    SAMPLE_WINDOW sampled = { 0, 0, 0 };
+    PREFETCHER hb_prefetch(hb_prefetch_kind, KnobPrefetchDegree.Value(), KnobPrefetchLate.Value(),
+			   KnobLineSize.Value());
+    PREFETCHER xeon_prefetch(xeon_prefetch_kind, KnobPrefetchDegree.Value(), KnobPrefetchLate.Value(),
+			     INTEL_CACHELINE_SIZE);
+
+    for (UINT32 tid = 0; tid < num_threads; tid++) {
+	const THREAD_DATA *td = thread_data[tid];
+	if (!td)
+	    continue;
+
+	threads++;
+	if (td->hb_prefetcher)
+	    hb_prefetch.Add(*td->hb_prefetcher);
+	if (td->xeon_prefetcher)
+	    xeon_prefetch.Add(*td->xeon_prefetcher);
+	instructions += td->Instructions();
+	hammerblade_misses += td->HammerbladeMisses();
+	intel_misses += td->IntelMisses();
+	hbm_bytes += td->hbm.bytes;
+	hbm_joules += td->hbm.joules;
+	sampled.instructions += td->sampled.instructions;
+	sampled.hammerblade_misses += td->sampled.hammerblade_misses;
+	sampled.intel_misses += td->sampled.intel_misses;
+    }
+
+    if (!last && instructions < telemetry_next)
+	return;
+    if (KnobTelemetryInstructions.Value())
+	telemetry_next = (instructions / KnobTelemetryInstructions.Value() + 1) * KnobTelemetryInstructions.Value();
+
+    double scale = 1;
+    if (sampling) {
+	// no estimate before the first window closes
+	if (sampled.instructions == 0) {
+	    telemetry_file << std::fixed << std::setprecision(3) << TelemetrySeconds() << ","
+			   << threads << "," << instructions << ",,,,,,,," << std::endl;
+	    return;
+	}
+
+	// the HBM and prefetcher counters also hold the open window, so they come out a little high
+	scale = (double) instructions / sampled.instructions;
+	hammerblade_misses = (UINT64) (sampled.hammerblade_misses * scale + 0.5);
+	intel_misses = (UINT64) (sampled.intel_misses * scale + 0.5);
+	hbm_bytes = (UINT64) (hbm_bytes * scale + 0.5);
+	hbm_joules *= scale;
+    }
+
+    const double hammerblade_joules = HammerBladeJoules(instructions, hammerblade_misses,
+							hb_prefetching ? &hb_prefetch : NULL, scale);
+    const double xeon_joules = XeonJoules(instructions, intel_misses,
+					  xeon_prefetching ? &xeon_prefetch : NULL, scale);
+
+    telemetry_file << std::fixed << std::setprecision(3) << TelemetrySeconds() << ","
+		   << threads << ","
+		   << instructions << ","
+		   << hammerblade_misses << ","
+		   << intel_misses << ","
+		   << std::scientific << std::setprecision(6)
+		   << hammerblade_joules << ","
+		   << xeon_joules << ","
+		   << (hammerblade_joules > 0 ? instructions / 1e9 / hammerblade_joules : 0) << ","
+		   << (xeon_joules > 0 ? instructions / 1e9 / xeon_joules : 0) << ","
+		   << hbm_bytes << ","
+		   << hbm_joules << std::endl;
+}
+
+static VOID TelemetryThread(VOID *arg)
+{
+    const UINT32 nap = 100;	// ms, so that exiting never waits for a whole period
+
+    while (!telemetry_exiting && !PIN_IsProcessExiting()) {
+	for (UINT32 slept = 0; slept < KnobTelemetryMs.Value() && !telemetry_exiting; slept += nap)
+	    PIN_Sleep(std::min(nap, KnobTelemetryMs.Value() - slept));
+	if (!telemetry_exiting)
+	    WriteTelemetryRow(false);
+    }
+}
+
+/* The last row has the totals at exit; under sampling, the windows still open are left out */
+static VOID TelemetryPrepareForFini(VOID *v)
+{
+    telemetry_exiting = true;
+    PIN_WaitForThreadTermination(telemetry_thread_uid, PIN_INFINITE_TIMEOUT, NULL);
+    WriteTelemetryRow(true);
+    telemetry_file.close();
+}
+
+static bool StartTelemetry()
+{
+    if (KnobTelemetryMs.Value() == 0) {
+	cerr << "Error: -telemetry_ms must be at least 1\n";
+	return false;
+    }
+
+    telemetry_file.open(KnobTelemetry.Value().c_str());
+    if (!telemetry_file) {
+	cerr << "Error: could not open " << KnobTelemetry.Value() << "\n";
+	return false;
+    }
+
+    telemetry_file << "seconds,threads,instructions,hammerblade_misses,xeon_misses,"
+		   << "hammerblade_joules,xeon_joules,hammerblade_gops_per_watt,xeon_gops_per_watt,"
+		   << "hbm_bytes,hbm_joules" << std::endl;
+    clock_gettime(CLOCK_MONOTONIC, &telemetry_start);
+
+    if (PIN_SpawnInternalThread(TelemetryThread, 0, 0, &telemetry_thread_uid) == INVALID_THREADID) {
+	cerr << "Error: could not start the telemetry thread\n";
+	return false;
+    }
+
+    PIN_AddPrepareForFiniFunction(TelemetryPrepareForFini, 0);
+    return true;
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+/* APPEND knobs hold their empty default until they are given */
+static bool HasValue(const KNOB<string> &knob)
+{
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++) {
+	if (!knob.Value(i).empty())
+	    return true;
+    }
+    return false;
+}
+
+
+int main(int argc, char *argv[])
+{
+    PIN_InitSymbols();
+
+    if( PIN_Init(argc,argv) )
+    {
+        return Usage();
+    }
+
+    outFile.open(KnobOutputFile.Value().c_str());
+
+    thread_data_key = PIN_CreateThreadDataKey(NULL);
+    thread_data_reg = PIN_ClaimToolRegister();
+    if (!REG_valid(thread_data_reg)) {
+	cerr << "Error: no tool register available for the thread data\n";
+	return 1;
+    }
+
+    PIN_InitLock(&epoch_lock);
+
+    for (UINT32 i = 0; i < KnobRtnEpochMarker.NumberOfValues(); i++) {
+	if (!KnobRtnEpochMarker.Value(i).empty())
+	    epoch_markers.insert(KnobRtnEpochMarker.Value(i));
+    }
+    for (UINT32 i = 0; i < KnobKernel.NumberOfValues(); i++) {
+	if (!KnobKernel.Value(i).empty()
+	    && std::find(kernels.begin(), kernels.end(), KnobKernel.Value(i)) == kernels.end())
+	    kernels.push_back(KnobKernel.Value(i));
+    }
+
+    const bool roi_start = HasValue(KnobRoiStart) || KnobRoiMagic.Value();
+
+    roi_markers = roi_start || HasValue(KnobRoiStop);
+    if (roi_markers) {
+	// without a start marker the region starts right away
+	roi_active = !roi_start;
+	roi_entries = roi_active;
+	PIN_InitLock(&roi_lock);
+	IMG_AddInstrumentFunction(RoiImage, 0);
+    }
+
+    hbm_tables = new HBM_TABLES();
+    hbm_burst = KnobHbmBurst.Value() ? KnobHbmBurst.Value() : hbm_tables->MaxBurst();
+    hbm_window = KnobHbmWindow.Value() ? KnobHbmWindow.Value() : KnobHbCores.Value();
+
+    hb_prefetching = KnobHbPrefetch.Value() != "off";
+    xeon_prefetching = KnobXeonPrefetch.Value() != "off";
+    hb_prefetch_kind = xeon_prefetch_kind = PREFETCH::KIND_NONE;
+    if ((hb_prefetching && !PREFETCH::ParseKind(KnobHbPrefetch.Value(), hb_prefetch_kind))
+	|| (xeon_prefetching && !PREFETCH::ParseKind(KnobXeonPrefetch.Value(), xeon_prefetch_kind))) {
+	cerr << "Error: -hb_prefetch and -xeon_prefetch take off, none, next_line or stride\n";
+	return Usage();
+    }
+
+    // IsPower2(0) holds, but a zero would size the channel model from ~0
+    if (KnobHbmGBps.Value() == 0) {
+	cerr << "Error: -hbm_gbps must be nonzero\n";
+	return Usage();
+    }
+    if (KnobHbmChannels.Value() == 0 || KnobHbmBanks.Value() == 0 || KnobHbmInterleave.Value() == 0
+	|| !IsPower2(KnobHbmChannels.Value()) || !IsPower2(KnobHbmBanks.Value())
+	|| !IsPower2(KnobHbmInterleave.Value())) {
+	cerr << "Error: -hbm_channels, -hbm_banks and -hbm_interleave must be nonzero powers of 2\n";
+	return Usage();
+    }
+
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
+
+    RTN_AddInstrumentFunction(Routine, NULL);
+
+    threshold[COUNTER_HIT] = KnobThresholdHit.Value();
+    threshold[COUNTER_MISS] = KnobThresholdMiss.Value();
+
+    if (KnobTrackLoads.Value() || KnobTrackStores.Value()) {
+	PIN_RWMutexInit(&allocation_lock);
+	memop_sources.resize(1);	// for NO_SLOT
+	IMG_AddInstrumentFunction(Image, 0);
+    }
+
+    filter.Activate();
+
+    if (KnobBuffer.Value()) {
+	if (!KnobBblCount.Value()) {
+	    cerr << "-buffer requires -bbl 1\n";
+	    return Usage();
+	}
+	/*
+	 * The simulation thread takes the buffers of different threads in no
+	 * particular order, so it cannot tell which epoch another thread's
+	 * queued accesses belong to.
+	 */
+	if (!epoch_markers.empty()) {
+	    cerr << "-buffer cannot be combined with -epoch_marker\n";
+	    return Usage();
+	}
+
+	memref_buffer = PIN_DefineTraceBuffer(sizeof(MEMREF), KnobBufferPages.Value(),
+					      BufferFull, 0);
+	if (memref_buffer == BUFFER_ID_INVALID) {
+	    cerr << "Error: could not allocate the trace buffer\n";
+	    return 1;
+	}
+
+	PIN_InitLock(&buffer_lock);
+	PIN_InitLock(&sim_lock);
+	PIN_SemaphoreInit(&buffer_full_sem);
+
+	if (PIN_SpawnInternalThread(SimulationThread, 0, 0, &sim_thread_uid) == INVALID_THREADID) {
+	    cerr << "Error: could not start the simulation thread\n";
+	    return 1;
+	}
+
+	PIN_AddPrepareForFiniFunction(BufferPrepareForFini, 0);
+    }
+
+    if (!KnobTraceOut.Value().empty()) {
+	if (KnobBuffer.Value()) {
+	    cerr << "-trace_out does not support -buffer\n";
+	    return Usage();
+	}
+
+	trace_file.open(KnobTraceOut.Value().c_str(), std::ios::binary);
+	if (!trace_file) {
+	    cerr << "Error: could not open " << KnobTraceOut.Value() << "\n";
+	    return 1;
+	}
+
+	TRACE_FILE_HEADER header;
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.reserved = 0;
+	trace_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	PIN_InitLock(&trace_lock);
+	tracing = true;
+    }
+
+    UINT32 min_line_size = std::min(KnobLineSize.Value(), (UINT32) INTEL_CACHELINE_SIZE);
+
+    if (KnobSweep.Value()) {
+	sweep_min_kb = 1 << FloorLog2(std::max(KnobSweepMinKB.Value(), 1u));
+	sweep_max_kb = 1 << FloorLog2(std::max(KnobSweepMaxKB.Value(), sweep_min_kb));
+	std::istringstream lines(KnobSweepLines.Value());
+	std::vector<UINT32> line_sizes;
+	UINT32 line_size;
+
+	while (lines >> line_size) {
+	    if (!IsPower2(line_size) || line_size > sweep_min_kb * KILO) {
+		cerr << "Error: bad -sweep_lines entry " << line_size << "\n";
+		return Usage();
+	    }
+	    line_sizes.push_back(line_size);
+	    min_line_size = std::min(min_line_size, line_size);
+
+	    if (lines.peek() == ',')
+		lines.ignore();
+	}
+
+	// every thread gets its own sweeps, so halve the largest cache until they all fit
+	sweep_threads = ExpectedThreads();
+	const UINT64 budget = (UINT64) KnobSweepMB.Value() * KILO * KILO / sweep_threads;
+	for (;;) {
+	    sweep_configs.clear();
+	    for (UINT32 i = 0; i < line_sizes.size(); i++)
+		sweep_configs.push_back(SweepConfig(line_sizes[i], sweep_min_kb, sweep_max_kb));
+	    if (sweep_max_kb == sweep_min_kb || SweepBytes(sweep_configs) <= budget)
+		break;
+	    sweep_max_kb /= 2;
+	    sweep_lowered = true;
+	}
+    }
+
+    if (KnobSamplePeriod.Value()) {
+	const UINT64 period = KnobSamplePeriod.Value();
+	const UINT64 detail = KnobSampleDetail.Value();
+	const UINT64 warm = KnobSampleWarm.Value();
+
+	if (!KnobBblCount.Value() || KnobBuffer.Value() || tracing) {
+	    cerr << "-sample_period requires -bbl 1 and does not support -buffer or -trace_out\n";
+	    return Usage();
+	}
+	if (detail == 0 || warm + detail > period) {
+	    cerr << "Error: -sample_period must cover -sample_warm plus a nonzero -sample_detail\n";
+	    return Usage();
+	}
+
+	sample_length[SAMPLE_FAST_FORWARD] = period - warm - detail;
+	sample_length[SAMPLE_WARM] = warm;
+	sample_length[SAMPLE_DETAILED] = detail;
+	sampling = true;
+    }
+
+    if (KnobBblCount.Value()) {
+	// the inline filter relies on every miss allocating its line, which
+	// also makes a filtered access an MRU hit in the thread's -sweep caches
+	ASSERTX(DL1::allocation == CACHE_ALLOC::STORE_ALLOCATE);
+	last_line_shift = FloorLog2(min_line_size);
+    }
+
+    // after the sampling setup, which the telemetry thread reads
+    if (!KnobTelemetry.Value().empty() && !StartTelemetry())
+	return 1;
+
+    TRACE_AddInstrumentFunction(Trace, 0);
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
@@ -0,0 +1,403 @@
+/*
+ * hbreplay: replays a trace written by hbpintool -trace_out through the
+ * same cache and energy models, without Pin.
+ *
+ * The trace is mapped read only and decoded in place. Every pair of
+ * (configuration, application thread) is an independent work item, and
+ * the work items run on a pool of native threads.
+ *
+ * Build with: make -f native.mk
+ */
+
+#include "native_compat.H"
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dcache.H"
+#include "cache_hierarchy.H"
+#include "energy_model.H"
+#include "hbm_model.H"
+#include "trace_format.H"
+
+/* ===================================================================== */
+/* Configurations                                                        */
+/* ===================================================================== */
+
+const UINT32 max_sets = 64 * KILO;
+const UINT32 max_associativity = 16;
+
+// -c 0 is the pintool's cold miss model, anything else a real cache
+typedef CACHE_COLD_MISS(CACHE_ALLOC::STORE_ALLOCATE) CACHE_HAMMERBLADE_COLD;
+typedef CACHE_ROUND_ROBIN(max_sets, max_associativity, CACHE_ALLOC::STORE_ALLOCATE) CACHE_HAMMERBLADE;
+
+struct CONFIG
+{
+    bool xeon;
+    UINT32 line_size;
+    UINT32 cache_kb;	// 0 for the cold miss model
+    UINT32 associativity;
+};
+
+/*
+ * Totals of one configuration over one application thread, or summed
+ * over all of them
+ */
+struct RESULT
+{
+    UINT64 instructions;
+    UINT64 misses;
+    UINT64 l1_misses, l2_misses, llc_misses;	// Xeon only
+    UINT64 hbm_bursts, hbm_bytes;		// cold HammerBlade only
+    double hbm_joules;
+};
+
+struct WORK
+{
+    UINT32 config;
+    UINT32 thread;	// index into thread_chunks
+};
+
+HBM_TABLES *hbm_tables = NULL;
+UINT32 hbm_burst;
+UINT32 hbm_gbps = 256;	// the pintool's -hbm_gbps default
+
+std::vector<CONFIG> configs;
+std::vector<std::vector<const TRACE_CHUNK_HEADER*> > thread_chunks;	// in file order
+
+std::vector<WORK> work;
+std::vector<std::vector<RESULT> > results;	// by config, then thread
+std::atomic<UINT32> next_work(0);
+
+/* ===================================================================== */
+/* Replay                                                                */
+/* ===================================================================== */
+
+static CACHE_HAMMERBLADE_COLD *NewCache(const CONFIG &config, CACHE_HAMMERBLADE_COLD *, HBM_MODEL *hbm)
+{
+    CACHE_HAMMERBLADE_COLD *cache = new CACHE_HAMMERBLADE_COLD("HammerBlade L1", config.line_size, config.line_size, 1);
+    cache->SetMissCallback(HBM_MODEL::MissCallback, hbm);
+    return cache;
+}
+
+static CACHE_HAMMERBLADE *NewCache(const CONFIG &config, CACHE_HAMMERBLADE *, HBM_MODEL *hbm)
+{
+    return new CACHE_HAMMERBLADE("HammerBlade L1", config.cache_kb * KILO,
+				 config.line_size, config.associativity);
+}
+
+static XEON_CACHES *NewCache(const CONFIG &config, XEON_CACHES *, HBM_MODEL *hbm)
+{
+    return new XEON_CACHES();
+}
+
+/* an epoch mark empties the HammerBlade caches in place, like the pintool */
+static VOID ResetCache(CACHE_HAMMERBLADE_COLD *cache) { cache->Reset(); }
+static VOID ResetCache(CACHE_HAMMERBLADE *cache) { cache->Reset(); }
+static VOID ResetCache(XEON_CACHES *cache) {}
+
+static VOID CountLevels(const XEON_CACHES *cache, RESULT &result)
+{
+    result.l1_misses = cache->L1Misses();
+    result.l2_misses = cache->L2Misses();
+    result.llc_misses = cache->LlcMisses();
+}
+
+static VOID CountLevels(const CACHE_BASE *cache, RESULT &result)
+{
+}
+
+/*
+ * Like the pintool, an instruction misses if any of its accesses does,
+ * and an epoch mark empties the HammerBlade cache but not the Xeon's.
+ */
+template <class CACHE>
+static VOID Replay(const CONFIG &config, const std::vector<const TRACE_CHUNK_HEADER*> &chunks,
+		   RESULT &result)
+{
+    HBM_MODEL hbm(hbm_tables, config.line_size, hbm_burst, hbm_gbps * 1e9);
+    CACHE *cache = NewCache(config, (CACHE*) NULL, &hbm);
+    TRACE_RECORD record;
+
+    for (UINT32 i = 0; i < chunks.size(); i++) {
+	TRACE_CHUNK_READER reader(chunks[i]);
+
+	while (reader.Next(record)) {
+	    result.instructions += record.instructions;
+
+	    if (record.kind == TRACE_MARK) {
+		if (record.mark == TRACE_MARK_EPOCH)
+		    ResetCache(cache);
+		continue;
+	    }
+
+	    bool hit = true;
+	    if (record.read_size)
+		hit &= cache->Access(record.read_addr, record.read_size, CACHE_BASE::ACCESS_TYPE_LOAD);
+	    if (record.write_size)
+		hit &= cache->Access(record.write_addr, record.write_size, CACHE_BASE::ACCESS_TYPE_STORE);
+	    if (!hit)
+		result.misses++;
+	}
+    }
+
+    CountLevels(cache, result);
+    delete cache;
+
+    hbm.Flush();
+    if (config.cache_kb == 0 && !config.xeon) {
+	result.hbm_bursts = hbm.bursts;
+	result.hbm_bytes = hbm.bytes;
+	result.hbm_joules = hbm.joules;
+    }
+}
+
+static VOID Worker()
+{
+    for (UINT32 i = next_work++; i < work.size(); i = next_work++) {
+	const CONFIG &config = configs[work[i].config];
+	const std::vector<const TRACE_CHUNK_HEADER*> &chunks = thread_chunks[work[i].thread];
+	RESULT &result = results[work[i].config][work[i].thread];
+
+	if (config.xeon)
+	    Replay<XEON_CACHES>(config, chunks, result);
+	else if (config.cache_kb == 0)
+	    Replay<CACHE_HAMMERBLADE_COLD>(config, chunks, result);
+	else
+	    Replay<CACHE_HAMMERBLADE>(config, chunks, result);
+    }
+}
+
+/* ===================================================================== */
+/* Report                                                                */
+/* ===================================================================== */
+
+static VOID Report(std::ostream &out, const std::string &trace_name, UINT64 trace_bytes)
+{
+    out << "Trace " << trace_name << ": " << trace_bytes << " bytes, "
+	<< thread_chunks.size() << " threads\n\n";
+
+    out << std::setw(16) << "machine"
+	<< std::setw(8)  << "line"
+	<< std::setw(8)  << "size"
+	<< std::setw(6)  << "ways"
+	<< std::setw(16) << "instructions"
+	<< std::setw(14) << "misses"
+	<< std::setw(12) << "GOPS/Watt"
+	<< std::setw(12) << "HBM-J" << "\n";
+
+    for (UINT32 c = 0; c < configs.size(); c++) {
+	const CONFIG &config = configs[c];
+	RESULT total;
+
+	memset(&total, 0, sizeof(total));
+	for (UINT32 t = 0; t < thread_chunks.size(); t++) {
+	    const RESULT &result = results[c][t];
+
+	    total.instructions += result.instructions;
+	    total.misses += result.misses;
+	    total.l1_misses += result.l1_misses;
+	    total.l2_misses += result.l2_misses;
+	    total.llc_misses += result.llc_misses;
+	    total.hbm_bursts += result.hbm_bursts;
+	    total.hbm_bytes += result.hbm_bytes;
+	    total.hbm_joules += result.hbm_joules;
+	}
+
+	double joules = config.xeon
+	    ? XeonJoules(total.instructions, total.misses, config.line_size)
+	    : HammerBladeJoules(total.instructions, total.misses, config.line_size);
+
+	out << std::setw(16) << (config.xeon ? "Xeon E7-8894 v4" : "HammerBlade")
+	    << std::setw(8)  << config.line_size
+	    << std::setw(8)  << (config.xeon ? "L1-LLC" : config.cache_kb ? decstr(config.cache_kb) + "KB" : "cold")
+	    << std::setw(6)  << (config.xeon || config.cache_kb == 0 ? "-" : decstr(config.associativity))
+	    << std::setw(16) << total.instructions
+	    << std::setw(14) << total.misses
+	    << std::setw(12) << std::setprecision(3) << std::scientific
+	    << (joules > 0 ? total.instructions / 1e9 / joules : 0);
+
+	if (!config.xeon && config.cache_kb == 0)
+	    out << std::setw(12) << total.hbm_joules;
+	else
+	    out << std::setw(12) << "-";
+	out << std::setprecision(6) << "\n";
+
+	if (config.xeon)
+	    out << std::setw(16) << "" << "  " << total.l1_misses << " L1, " << total.l2_misses
+		<< " L2, " << total.llc_misses << " LLC line misses\n";
+    }
+}
+
+/* ===================================================================== */
+/* Main                                                                  */
+/* ===================================================================== */
+
+static int Usage(const char *name)
+{
+    cerr << "Usage: " << name << " [options] TRACE\n"
+	 << "Replays a trace written by hbpintool -trace_out.\n"
+	 << "Options:\n"
+	 << "    -b LIST     HammerBlade line sizes in bytes (default 32)\n"
+	 << "    -c LIST     HammerBlade cache sizes in KB, 0 for cold misses only (default 0)\n"
+	 << "    -a WAYS     associativity of the sized caches (default 4)\n"
+	 << "    -j THREADS  replay threads (default: all processors)\n"
+	 << "    -hbm_burst  largest HBM burst in bytes (default: largest in the tables)\n"
+	 << "    -hbm_gbps   peak HBM bandwidth in GB/s (default 256)\n"
+	 << "    -o FILE     write the report to FILE instead of stdout\n";
+    return 1;
+}
+
+static bool ParseList(const std::string &text, std::vector<UINT32> &values)
+{
+    std::istringstream in(text);
+    UINT32 value;
+
+    values.clear();
+    while (in >> value) {
+	values.push_back(value);
+	if (in.peek() == ',')
+	    in.ignore();
+    }
+    return in.eof() && !values.empty();
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<UINT32> line_sizes(1, 32), cache_kbs(1, 0);
+    UINT32 associativity = 4;
+    UINT32 num_workers = std::max(std::thread::hardware_concurrency(), 1u);
+    UINT32 burst = 0;
+    std::string output, trace_name;
+
+    for (int i = 1; i < argc; i++) {
+	std::string arg = argv[i];
+	bool has_value = i + 1 < argc;
+
+	if (arg == "-b" && has_value) {
+	    if (!ParseList(argv[++i], line_sizes))
+		return Usage(argv[0]);
+	} else if (arg == "-c" && has_value) {
+	    if (!ParseList(argv[++i], cache_kbs))
+		return Usage(argv[0]);
+	} else if (arg == "-a" && has_value) {
+	    associativity = atoi(argv[++i]);
+	} else if (arg == "-j" && has_value) {
+	    num_workers = std::max(atoi(argv[++i]), 1);
+	} else if (arg == "-hbm_burst" && has_value) {
+	    burst = atoi(argv[++i]);
+	} else if (arg == "-hbm_gbps" && has_value) {
+	    hbm_gbps = atoi(argv[++i]);
+	    if (hbm_gbps == 0)
+		return Usage(argv[0]);
+	} else if (arg == "-o" && has_value) {
+	    output = argv[++i];
+	} else if (arg[0] != '-' && trace_name.empty()) {
+	    trace_name = arg;
+	} else {
+	    return Usage(argv[0]);
+	}
+    }
+    if (trace_name.empty())
+	return Usage(argv[0]);
+
+    for (UINT32 b = 0; b < line_sizes.size(); b++) {
+	for (UINT32 c = 0; c < cache_kbs.size(); c++) {
+	    CONFIG config = { false, line_sizes[b], cache_kbs[c], associativity };
+	    UINT64 lines = (UINT64) config.cache_kb * KILO / config.line_size;
+
+	    if (!IsPower2(config.line_size)
+		|| (config.cache_kb && (associativity == 0 || associativity > max_associativity
+					|| lines < associativity || lines / associativity > max_sets
+					|| !IsPower2(lines / associativity)))) {
+		cerr << "Error: unsupported cache of " << config.cache_kb << "KB with "
+		     << config.line_size << " byte lines and " << associativity << " ways\n";
+		return 1;
+	    }
+	    configs.push_back(config);
+	}
+    }
+    CONFIG xeon = { true, INTEL_CACHELINE_SIZE, 0, 0 };
+    configs.push_back(xeon);
+
+    hbm_tables = new HBM_TABLES();
+    hbm_burst = burst ? burst : hbm_tables->MaxBurst();
+
+    // map the trace; chunks are decoded straight from the mapping
+    int fd = open(trace_name.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+	cerr << "Error: could not open " << trace_name << "\n";
+	return 1;
+    }
+
+    const UINT8 *data = NULL;
+    if (st.st_size > 0) {
+	void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED) {
+	    cerr << "Error: could not map " << trace_name << "\n";
+	    return 1;
+	}
+	madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+	data = static_cast<const UINT8*>(mapping);
+    }
+    close(fd);
+
+    TRACE_FILE trace;
+    if (!data || !trace.Open(data, st.st_size)) {
+	cerr << "Error: " << trace_name << " is not a complete version "
+	     << TRACE_VERSION << " trace\n";
+	return 1;
+    }
+
+    std::map<UINT32, UINT32> thread_index;
+    for (UINT32 i = 0; i < trace.NumChunks(); i++) {
+	const TRACE_CHUNK_HEADER *chunk = trace.Chunk(i);
+
+	if (thread_index.find(chunk->thread) == thread_index.end()) {
+	    thread_index[chunk->thread] = thread_chunks.size();
+	    thread_chunks.push_back(std::vector<const TRACE_CHUNK_HEADER*>());
+	}
+	thread_chunks[thread_index[chunk->thread]].push_back(chunk);
+    }
+
+    RESULT zero;
+    memset(&zero, 0, sizeof(zero));
+    results.assign(configs.size(), std::vector<RESULT>(thread_chunks.size(), zero));
+
+    for (UINT32 c = 0; c < configs.size(); c++) {
+	for (UINT32 t = 0; t < thread_chunks.size(); t++) {
+	    WORK item = { c, t };
+	    work.push_back(item);
+	}
+    }
+
+    std::vector<std::thread> workers;
+    for (UINT32 i = 0; i < std::min(num_workers, (UINT32) work.size()); i++)
+	workers.push_back(std::thread(Worker));
+    for (UINT32 i = 0; i < workers.size(); i++)
+	workers[i].join();
+
+    if (output.empty()) {
+	Report(std::cout, trace_name, st.st_size);
+    } else {
+	std::ofstream out(output.c_str());
+	Report(out, trace_name, st.st_size);
+    }
+
+    munmap(const_cast<UINT8*>(data), st.st_size);
+    return 0;
+}
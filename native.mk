@@ -0,0 +1,33 @@
+##############################################################
+#
+# Native builds of the parts that do not need Pin:
+#
+#   make -f native.mk          builds obj-native/hbreplay and cachebench
+#   make -f native.mk check    also runs the unit tests and compares the
+#                              cachebench miss counts to cachebench.golden
+#
+##############################################################
+
+CXX ?= g++
+NATIVE_CXXFLAGS := -O2 -g -std=c++11 -Wall -Wno-unused-function -pthread
+NATIVE_OBJDIR := obj-native
+
+NATIVE_HEADERS := native_compat.H dcache.H cache_hierarchy.H energy_model.H \
+                  hbm_model.H hbm_latency.inc hbm_power.inc trace_format.H prefetch.H
+
+NATIVE_TESTS := trace_test
+
+all: $(NATIVE_OBJDIR)/hbreplay $(NATIVE_OBJDIR)/cachebench
+
+check: all $(NATIVE_TESTS:%=$(NATIVE_OBJDIR)/%)
+	@for test in $(NATIVE_TESTS); do $(NATIVE_OBJDIR)/$$test || exit 1; done
+	$(NATIVE_OBJDIR)/cachebench -check cachebench.golden
+
+$(NATIVE_OBJDIR)/%: %.cpp $(NATIVE_HEADERS)
+	@mkdir -p $(NATIVE_OBJDIR)
+	$(CXX) $(NATIVE_CXXFLAGS) -o $@ $<
+
+clean:
+	rm -rf $(NATIVE_OBJDIR)
+
+.PHONY: all check clean
@@ -0,0 +1,161 @@
+/*
+ * Round trip test of trace_format.H: random records of several threads
+ * are encoded into small chunks, collected into a trace file image and
+ * decoded again.
+ *
+ * Run with: make -f native.mk check
+ */
+
+#include "native_compat.H"
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+#include "trace_format.H"
+
+static std::vector<UINT8> image;
+
+static VOID AppendChunk(const TRACE_CHUNK_HEADER &header, const UINT8 *records, VOID *arg)
+{
+    const UINT8 *bytes = reinterpret_cast<const UINT8*>(&header);
+
+    image.insert(image.end(), bytes, bytes + sizeof(header));
+    image.insert(image.end(), records, records + TracePadded(header.bytes));
+}
+
+static UINT64 Random(UINT64 &state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static TRACE_RECORD RandomRecord(UINT64 &state)
+{
+    static const UINT32 sizes[] = { 1, 2, 4, 8, 16, 32, 64, 10, 512 };
+    TRACE_RECORD record;
+
+    memset(&record, 0, sizeof(record));
+    record.instructions = Random(state) % 4 == 0 ? Random(state) % 100000 : Random(state) % 8;
+
+    switch (Random(state) % 16) {
+    case 0:
+	record.kind = TRACE_MARK;
+	record.mark = Random(state) % 2 ? TRACE_MARK_EPOCH : TRACE_MARK_INSTRUCTIONS;
+	return record;
+    case 1: case 2:
+	record.kind = TRACE_LOAD_STORE;
+	break;
+    case 3: case 4: case 5: case 6:
+	record.kind = TRACE_STORE;
+	break;
+    default:
+	record.kind = TRACE_LOAD;
+	break;
+    }
+
+    // mostly small strides, sometimes far jumps in either direction
+    static ADDRINT base = 0x7f0000000000ULL;
+    base += Random(state) % 8 == 0 ? ADDRINT(Random(state)) : ADDRINT(INT64(Random(state) % 512) - 128);
+
+    if (record.kind != TRACE_STORE) {
+	record.read_addr = base;
+	record.read_size = sizes[Random(state) % 9];
+    }
+    if (record.kind != TRACE_LOAD) {
+	record.write_addr = record.kind == TRACE_STORE ? base : base + ADDRINT(INT64(Random(state) % 64) - 32);
+	record.write_size = sizes[Random(state) % 9];
+    }
+    return record;
+}
+
+static bool Same(const TRACE_RECORD &a, const TRACE_RECORD &b)
+{
+    return a.kind == b.kind && a.mark == b.mark && a.instructions == b.instructions
+	&& a.read_addr == b.read_addr && a.read_size == b.read_size
+	&& a.write_addr == b.write_addr && a.write_size == b.write_size;
+}
+
+int main()
+{
+    const UINT32 num_threads = 3;
+    const UINT32 num_records = 200000;
+
+    TRACE_FILE_HEADER header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.reserved = 0;
+    image.insert(image.end(), reinterpret_cast<const UINT8*>(&header),
+		 reinterpret_cast<const UINT8*>(&header) + sizeof(header));
+
+    std::vector<TRACE_WRITER*> writers;
+    std::vector<UINT64> instructions(num_threads, 0);
+    std::vector<std::vector<TRACE_RECORD> > expected(num_threads);
+    UINT64 state = 88172645463325252ULL;
+
+    for (UINT32 t = 0; t < num_threads; t++)
+	writers.push_back(new TRACE_WRITER(t, 4096, AppendChunk, NULL));
+
+    // interleave the threads so that their chunks are mixed in the file
+    for (UINT32 i = 0; i < num_records; i++) {
+	const UINT32 t = Random(state) % num_threads;
+	TRACE_RECORD record = RandomRecord(state);
+
+	instructions[t] += record.instructions;
+	if (record.kind == TRACE_MARK)
+	    writers[t]->Mark(instructions[t], TRACE_MARK_TYPE(record.mark));
+	else
+	    writers[t]->Memop(instructions[t], record.read_addr, record.read_size,
+			      record.write_addr, record.write_size);
+	expected[t].push_back(record);
+    }
+    for (UINT32 t = 0; t < num_threads; t++)
+	writers[t]->Flush();
+
+    TRACE_FILE trace;
+    if (!trace.Open(&image[0], image.size())) {
+	cerr << "FAIL: could not open the trace\n";
+	return 1;
+    }
+
+    std::vector<UINT32> next(num_threads, 0);
+    UINT32 failures = 0;
+
+    for (UINT32 c = 0; c < trace.NumChunks(); c++) {
+	const TRACE_CHUNK_HEADER *chunk = trace.Chunk(c);
+	TRACE_CHUNK_READER reader(chunk);
+	TRACE_RECORD record;
+	UINT32 records = 0;
+
+	while (reader.Next(record)) {
+	    const UINT32 t = chunk->thread;
+
+	    if (next[t] >= expected[t].size() || !Same(record, expected[t][next[t]]))
+		failures++;
+	    next[t]++;
+	    records++;
+	}
+	if (records != chunk->records)
+	    failures++;
+    }
+    for (UINT32 t = 0; t < num_threads; t++) {
+	if (next[t] != expected[t].size())
+	    failures++;
+    }
+
+    // a cut off trace must be refused
+    if (trace.Open(&image[0], image.size() - 8))
+	failures++;
+
+    cout << trace.NumChunks() << " chunks, " << image.size() << " bytes for "
+	 << num_records << " records\n";
+
+    if (failures) {
+	cerr << "FAIL: " << failures << " mismatches\n";
+	return 1;
+    }
+    cout << "PASS\n";
+    return 0;
+}